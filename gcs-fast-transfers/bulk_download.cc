@@ -0,0 +1,484 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gcs_fast_transfers.h"
+#include "io_engine.h"
+#include <boost/program_options.hpp>
+#include <crc32c/crc32c.h>
+#include <fmt/format.h>
+#include <google/cloud/storage/client.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+// Posix headers last.
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+namespace po = boost::program_options;
+namespace gcs = google::cloud::storage;
+po::variables_map parse_command_line(int argc, char* argv[]);
+int check_system_call(std::string const& name, int result);
+
+using ::gcs_fast_transfers::combine_checksums;
+using ::gcs_fast_transfers::compute_slices;
+using ::gcs_fast_transfers::format_size;
+using ::gcs_fast_transfers::kMiB;
+using ::gcs_fast_transfers::pwrite_all;
+using ::gcs_fast_transfers::range_checksum;
+
+// The initial delay before restarting a failed slice request, doubled on each
+// consecutive failure.
+auto constexpr kRetryBackoff = std::chrono::milliseconds(100);
+
+/**
+ * The state of a single object in the bulk download.
+ *
+ * The destination file is opened when the first slice starts, and closed,
+ * and verified, when the last slice completes. Objects are scheduled largest
+ * first, so only a few files are open at any time.
+ */
+struct object_state {
+  object_state(gcs::ObjectMetadata m, std::string d, int s)
+      : metadata(std::move(m)),
+        destination(std::move(d)),
+        pending_slices(s) {}
+
+  gcs::ObjectMetadata metadata;
+  std::string destination;
+
+  std::mutex mu;
+  int fd = -1;
+  int pending_slices;
+  std::vector<range_checksum> checksums;
+  std::string error;
+};
+
+/// A slice of one object, the unit of work for the download streams.
+struct work_item {
+  std::shared_ptr<object_state> object;
+  std::int64_t offset;
+  std::int64_t length;
+};
+
+/// Map an object name to a path in the destination directory.
+std::optional<std::filesystem::path> destination_path(
+    std::filesystem::path const& directory, std::string const& name) {
+  auto const relative = std::filesystem::path(name).lexically_normal();
+  // Refuse to write outside the destination directory.
+  if (relative.empty() || relative.is_absolute() ||
+      *relative.begin() == "..") {
+    return std::nullopt;
+  }
+  if (not relative.has_filename()) return std::nullopt;
+  return directory / relative;
+}
+
+std::vector<gcs::ObjectMetadata> list_objects(gcs::Client client,
+                                              std::string const& bucket,
+                                              po::variables_map const& vm) {
+  std::vector<gcs::ObjectMetadata> objects;
+  if (vm.count("manifest") == 0) {
+    auto const prefix = vm["prefix"].as<std::string>();
+    for (auto& o : client.ListObjects(bucket, gcs::Prefix(prefix))) {
+      objects.push_back(std::move(o).value());
+    }
+    return objects;
+  }
+
+  // Fetch the metadata for the objects in the manifest in parallel, using the
+  // same number of streams as the download.
+  std::vector<std::string> names;
+  std::ifstream is(vm["manifest"].as<std::string>());
+  for (std::string line; std::getline(is, line);) {
+    if (not line.empty()) names.push_back(std::move(line));
+  }
+  objects.resize(names.size());
+  std::atomic<std::size_t> next{0};
+  std::vector<std::future<void>> tasks(
+      (std::min)(names.size(),
+                 static_cast<std::size_t>(vm["max-streams"].as<int>())));
+  std::generate(tasks.begin(), tasks.end(), [&] {
+    return std::async(std::launch::async, [&] {
+      for (auto i = next++; i < names.size(); i = next++) {
+        objects[i] = client.GetObjectMetadata(bucket, names[i]).value();
+      }
+    });
+  });
+  for (auto& t : tasks) t.get();
+  return objects;
+}
+
+/// Close and verify the destination file once all its slices are done.
+bool finish_slice(object_state& o, std::optional<range_checksum> checksum,
+                  std::string const& error) {
+  std::lock_guard<std::mutex> lk(o.mu);
+  if (checksum) o.checksums.push_back(*checksum);
+  if (not error.empty() && o.error.empty()) o.error = error;
+  if (--o.pending_slices != 0) return true;
+
+  if (o.fd != -1) ::close(o.fd);
+  o.fd = -1;
+  auto [size, crc32c] = combine_checksums(std::move(o.checksums));
+  if (o.error.empty() && size != static_cast<std::int64_t>(o.metadata.size())) {
+    o.error = fmt::format("size mismatch, expected={}, got={}",
+                          o.metadata.size(), size);
+  }
+  if (o.error.empty() && crc32c != o.metadata.crc32c()) {
+    o.error = fmt::format("CRC32C mismatch, expected={}, got={}",
+                          o.metadata.crc32c(), crc32c);
+  }
+  if (o.error.empty()) return true;
+  std::cerr << "Error downloading " << o.metadata.name() << ": " << o.error
+            << std::endl;
+  return false;
+}
+
+int open_destination(object_state& o) {
+  std::lock_guard<std::mutex> lk(o.mu);
+  if (o.fd != -1) return o.fd;
+  auto constexpr kOpenFlags = O_CREAT | O_TRUNC | O_WRONLY;
+  auto constexpr kOpenMode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
+  std::filesystem::create_directories(
+      std::filesystem::path(o.destination).parent_path());
+  o.fd = check_system_call(
+      "open()", ::open(o.destination.c_str(), kOpenFlags, kOpenMode));
+  return o.fd;
+}
+
+range_checksum download_slice(gcs::Client& client, std::vector<char>& buffer,
+                              work_item const& item, int retries) {
+  auto const& metadata = item.object->metadata;
+  auto const fd = open_destination(*item.object);
+  auto const end = item.offset + item.length;
+  // Pin the generation, so all the slices come from the same version of the
+  // object, including the retries.
+  auto read_range = [&](std::int64_t offset) {
+    return client.ReadObject(metadata.bucket(), metadata.name(),
+                             gcs::ReadRange(offset, end),
+                             gcs::Generation(metadata.generation()));
+  };
+  std::uint32_t crc = 0;
+  std::int64_t write_offset = item.offset;
+  int attempt = 0;
+  while (write_offset < end) {
+    auto is = read_range(write_offset);
+    do {
+      is.read(buffer.data(), buffer.size());
+      if (is.bad()) break;
+      pwrite_all(fd, buffer.data(), is.gcount(), write_offset);
+      crc = crc32c::Extend(crc, reinterpret_cast<std::uint8_t*>(buffer.data()),
+                           is.gcount());
+      write_offset += is.gcount();
+      if (is.gcount() != 0) attempt = 0;
+    } while (not is.eof());
+    if (write_offset >= end) break;
+    // Restart the request from the first byte not written yet, this also
+    // handles streams that end early without an error.
+    if (attempt == retries) {
+      throw std::runtime_error(fmt::format(
+          "error reading range [{}, {}): {}", write_offset, end,
+          is.bad() ? is.status().message() : "unexpected end of stream"));
+    }
+    std::this_thread::sleep_for(kRetryBackoff * (1 << attempt));
+    ++attempt;
+  }
+  return range_checksum{item.offset, write_offset - item.offset, crc};
+}
+
+struct worker_result {
+  std::int64_t bytes = 0;
+  std::int64_t failed_objects = 0;
+};
+
+worker_result worker(gcs::Client client, std::vector<work_item> const& items,
+                     std::atomic<std::size_t>& next, int retries) {
+  std::vector<char> buffer(1024 * 1024L);
+  worker_result result;
+  for (auto i = next++; i < items.size(); i = next++) {
+    auto const& item = items[i];
+    std::optional<range_checksum> checksum;
+    std::string error;
+    try {
+      checksum = download_slice(client, buffer, item, retries);
+      result.bytes += checksum->length;
+    } catch (std::exception const& ex) {
+      error = ex.what();
+    }
+    if (not finish_slice(*item.object, checksum, error)) {
+      ++result.failed_objects;
+    }
+  }
+  return result;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) try {
+  auto vm = parse_command_line(argc, argv);
+  auto const bucket = vm["bucket"].as<std::string>();
+  auto const destination =
+      std::filesystem::path(vm["destination"].as<std::string>());
+  auto const max_streams = vm["max-streams"].as<int>();
+  auto const minimum_slice_size = vm["minimum-slice-size"].as<std::int64_t>();
+
+  auto client = gcs::Client(
+      google::cloud::Options{}.set<gcs::ConnectionPoolSizeOption>(
+          max_streams));
+
+  auto const start = std::chrono::steady_clock::now();
+  auto objects = list_objects(client, bucket, vm);
+
+  // Small objects are downloaded in a single stream, large objects are split
+  // into slices. All the slices share the same pool of streams, so the total
+  // number of streams never exceeds `--max-streams`.
+  std::sort(objects.begin(), objects.end(),
+            [](auto const& a, auto const& b) { return a.size() > b.size(); });
+  std::int64_t skipped_objects = 0;
+  std::vector<std::pair<gcs::ObjectMetadata, std::filesystem::path>> targets;
+  for (auto& m : objects) {
+    // The console creates empty objects ending in `/` as folder placeholders,
+    // there is nothing to download for them.
+    if (m.size() == 0 && not m.name().empty() && m.name().back() == '/') {
+      continue;
+    }
+    auto path = destination_path(destination, m.name());
+    if (not path) {
+      std::cerr << "Skipping object " << m.name()
+                << ", its name is not a valid relative path" << std::endl;
+      ++skipped_objects;
+      continue;
+    }
+    targets.emplace_back(std::move(m), *std::move(path));
+  }
+
+  // Different names can map to the same file, for example `a//b` and `a/b`,
+  // or a file can be the directory of another object. Concurrent downloads
+  // would corrupt these files, skip all the objects involved.
+  std::map<std::filesystem::path, int> file_count;
+  std::set<std::filesystem::path> directories;
+  for (auto const& t : targets) {
+    ++file_count[t.second];
+    auto const relative = t.second.lexically_relative(destination);
+    for (auto p = relative.parent_path(); not p.empty(); p = p.parent_path()) {
+      directories.insert(destination / p);
+    }
+  }
+  std::vector<work_item> items;
+  std::int64_t total_size = 0;
+  std::int64_t object_count = 0;
+  for (auto& [m, path] : targets) {
+    if (file_count[path] != 1 || directories.count(path) != 0) {
+      std::cerr << "Skipping object " << m.name() << ", its destination "
+                << path << " conflicts with another object" << std::endl;
+      ++skipped_objects;
+      continue;
+    }
+    auto const size = static_cast<std::int64_t>(m.size());
+    auto slices = compute_slices(size, minimum_slice_size, max_streams);
+    // Empty objects still need an empty destination file.
+    if (slices.empty()) slices.push_back(0);
+    auto state = std::make_shared<object_state>(
+        std::move(m), path.string(), static_cast<int>(slices.size()));
+    std::int64_t offset = 0;
+    for (auto length : slices) {
+      items.push_back(work_item{state, offset, length});
+      offset += length;
+    }
+    total_size += size;
+    ++object_count;
+  }
+
+  std::cout << "Downloading " << object_count
+            << " objects from bucket " << bucket << " to " << destination
+            << "\n";
+  std::cout << "The total size is approximately " << format_size(total_size)
+            << ". It will be downloaded in " << items.size()
+            << " slices, using up to " << max_streams << " streams."
+            << std::endl;
+
+  std::atomic<std::size_t> next{0};
+  std::vector<std::future<worker_result>> tasks(
+      (std::min)(items.size(), static_cast<std::size_t>(max_streams)));
+  std::generate(tasks.begin(), tasks.end(), [&] {
+    return std::async(std::launch::async, worker, client, std::cref(items),
+                      std::ref(next), vm["range-retries"].as<int>());
+  });
+  worker_result totals;
+  for (auto& t : tasks) {
+    auto r = t.get();
+    totals.bytes += r.bytes;
+    totals.failed_objects += r.failed_objects;
+  }
+
+  auto const end = std::chrono::steady_clock::now();
+  auto const elapsed_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+  auto const elapsed_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+  auto const effective_bandwidth_MiBs =
+      (static_cast<double>(totals.bytes) / kMiB) /
+      (elapsed_us.count() / 1'000'000.0);
+  std::cout << "Downloaded " << format_size(totals.bytes) << " in "
+            << elapsed_ms.count() << "ms, including the listing\n"
+            << "Aggregate bandwidth " << effective_bandwidth_MiBs << " MiB/s\n";
+
+  if (totals.failed_objects != 0 || skipped_objects != 0) {
+    std::cout << totals.failed_objects << " objects failed and "
+              << skipped_objects << " objects were skipped" << std::endl;
+    return 1;
+  }
+  std::cout << "All file sizes and CRC32C checksums match expected values"
+            << std::endl;
+
+  return 0;
+} catch (std::exception const& ex) {
+  std::cerr << "Standard C++ exception thrown: " << ex.what() << std::endl;
+  return 1;
+} catch (...) {
+  std::cerr << "Unknown C++ exception thrown" << std::endl;
+  return 1;
+}
+
+namespace {
+char const* kPositional[] = {"bucket", "destination"};
+
+[[noreturn]] void usage(std::string const& argv0,
+                        po::options_description const& desc,
+                        std::string const& message = {}) {
+  auto exit_status = EXIT_SUCCESS;
+  if (not message.empty()) {
+    exit_status = EXIT_FAILURE;
+    std::cout << "Error: " << message << "\n";
+  }
+
+  // format positional args
+  auto const positional_names =
+      std::accumulate(std::begin(kPositional), std::end(kPositional),
+                      std::string{" [options]"}, [](auto a, auto const& b) {
+                        a += ' ';
+                        a += b;
+                        return a;
+                      });
+
+  // print usage + options help, and exit normally
+  std::cout << "usage: " << argv0 << positional_names << "\n\n" << desc << "\n";
+  std::exit(exit_status);
+}
+
+po::variables_map parse_command_line(int argc, char* argv[]) {
+  auto const default_minimum_slice_size = 64 * 1024 * 1024L;
+  auto const default_max_streams = [] {
+    auto constexpr kFallbackStreamCount = 2;
+    auto constexpr kStreamsPerCore = 2;
+    auto const count = std::thread::hardware_concurrency();
+    if (count == 0) return kFallbackStreamCount;
+    return static_cast<int>(count * kStreamsPerCore);
+  }();
+
+  po::positional_options_description positional;
+  for (auto const* name : kPositional) positional.add(name, 1);
+  po::options_description desc(
+      "Download many GCS objects using a shared pool of streams");
+  desc.add_options()("help", "produce help message")
+      //
+      ("bucket", po::value<std::string>()->required(),
+       "set the GCS bucket to download from")
+      //
+      ("destination", po::value<std::string>()->required(),
+       "set the directory to download into, object names are used as paths "
+       "relative to this directory")
+      //
+      ("prefix", po::value<std::string>()->default_value(""),
+       "download all the objects with this prefix")
+      //
+      ("manifest", po::value<std::string>(),
+       "download the objects listed in this file, one name per line, instead "
+       "of using --prefix")
+      //
+      ("max-streams", po::value<int>()->default_value(default_max_streams),
+       "maximum number of parallel streams across all objects")
+      //
+      ("minimum-slice-size",
+       po::value<std::int64_t>()->default_value(default_minimum_slice_size),
+       "objects smaller than this size are downloaded in a single stream, "
+       "larger objects are split in slices of at least this size")
+      //
+      ("range-retries", po::value<int>()->default_value(3),
+       "restart a failed slice request from the last byte received up to "
+       "this many times");
+
+  // parse the input into the map
+  po::variables_map vm;
+
+  // run notify() for all registered options in the map
+  try {
+    po::parsed_options parsed = po::command_line_parser(argc, argv)
+                                    .options(desc)
+                                    .positional(positional)
+                                    .run();
+    po::store(parsed, vm);
+    po::notify(vm);
+  } catch (std::exception const& ex) {
+    // if required arguments are missing but help is desired, just print help
+    if (vm.count("help") > 0 or argc == 1) usage(argv[0], desc);
+    usage(argv[0], desc, ex.what());
+  }
+
+  if (vm.count("help") != 0) usage(argv[0], desc);
+
+  for (std::string opt : kPositional) {
+    if (not vm[opt].as<std::string>().empty()) continue;
+    usage(argv[0], desc, fmt::format("the {} argument cannot be empty", opt));
+  }
+
+  if (vm["max-streams"].as<int>() <= 0) {
+    usage(argv[0], desc, "the --max-streams option must be positive");
+  }
+  if (vm["minimum-slice-size"].as<std::int64_t>() <= 0) {
+    usage(argv[0], desc, "the --minimum-slice-size option must be positive");
+  }
+  if (vm["range-retries"].as<int>() < 0) {
+    usage(argv[0], desc, "the --range-retries option cannot be negative");
+  }
+
+  return vm;
+}
+
+int check_system_call(std::string const& name, int result) {
+  if (result >= 0) return result;
+  auto err = errno;
+  throw std::runtime_error(
+      fmt::format("Error in {}() - return value={}, error=[{}] {}", name,
+                  result, err, strerror(err)));
+}
+
+}  // namespace
@@ -12,21 +12,38 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include "download_journal.h"
 #include "gcs_fast_transfers.h"
+#include "io_engine.h"
+#include "transfer_stats.h"
 #include <boost/program_options.hpp>
+#include <crc32c/crc32c.h>
 #include <fmt/format.h>
+#include <fmt/ranges.h>
 #include <google/cloud/storage/client.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <future>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <numeric>
+#include <optional>
 #include <string>
 #include <thread>
+#include <vector>
 // Posix headers last.
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 namespace {
 namespace po = boost::program_options;
@@ -34,50 +51,797 @@ namespace gcs = google::cloud::storage;
 po::variables_map parse_command_line(int argc, char* argv[]);
 int check_system_call(std::string const& name, int result);
 
-std::vector<std::int64_t> compute_slices(std::int64_t object_size,
-                                         po::variables_map const& vm) {
-  auto const minimum_slice_size = vm["minimum-slice-size"].as<std::int64_t>();
-  auto const thread_count = vm["thread-count"].as<int>();
-
-  std::vector<std::int64_t> result;
-  auto const thread_slice = object_size / thread_count;
-  if (thread_slice >= minimum_slice_size) {
-    std::fill_n(std::back_inserter(result), thread_count, thread_slice);
-    // If the object size is not a multiple of the thread count we may need
-    // to add any excess bytes to the last slice.
-    result.back() += object_size % thread_count;
-    return result;
+using ::gcs_fast_transfers::compute_slices;
+using ::gcs_fast_transfers::download_journal_writer;
+using ::gcs_fast_transfers::kDirectIoAlignment;
+using ::gcs_fast_transfers::kMiB;
+using ::gcs_fast_transfers::make_io_engine;
+using ::gcs_fast_transfers::make_progress_reporter;
+using ::gcs_fast_transfers::preallocate;
+using ::gcs_fast_transfers::range_checksum;
+using ::gcs_fast_transfers::stream_done_guard;
+using ::gcs_fast_transfers::transfer_stats;
+using ::gcs_fast_transfers::verify_ranges;
+using ::gcs_fast_transfers::write_stats_json;
+
+auto constexpr kBufferSize = std::size_t{1024 * 1024};
+// Record progress in the journal at least this often.
+auto constexpr kJournalInterval = std::int64_t{64 * 1024 * 1024};
+// The initial delay before restarting a failed range request, doubled on each
+// consecutive failure.
+auto constexpr kRetryBackoff = std::chrono::milliseconds(100);
+
+/// A half-open byte range `[offset, end)` in the object.
+struct range {
+  std::int64_t offset;
+  std::int64_t end;
+};
+
+/// Convert the output of `compute_slices()` to ranges.
+std::vector<range> to_ranges(std::vector<std::int64_t> const& slices) {
+  std::vector<range> result;
+  std::int64_t offset = 0;
+  for (auto length : slices) {
+    result.push_back(range{offset, offset + length});
+    offset += length;
   }
-  for (; object_size > 0; object_size -= minimum_slice_size) {
-    result.push_back(std::min(minimum_slice_size, object_size));
+  return result;
+}
+
+/**
+ * Drop the ranges that overlap a previous range.
+ *
+ * A journal can record overlapping ranges, for example, if a range that did
+ * not match its checksum was downloaded again, and the download was
+ * interrupted a second time. The checksums of overlapping ranges cannot be
+ * combined, the bytes of the dropped ranges are downloaded again.
+ */
+std::vector<range_checksum> remove_overlaps(
+    std::vector<range_checksum> ranges) {
+  std::sort(ranges.begin(), ranges.end(), [](auto const& a, auto const& b) {
+    return a.offset < b.offset ||
+           (a.offset == b.offset && a.length > b.length);
+  });
+  std::vector<range_checksum> result;
+  std::int64_t end = 0;
+  for (auto const& r : ranges) {
+    if (r.length == 0 || r.offset < end) continue;
+    result.push_back(r);
+    end = r.offset + r.length;
   }
   return result;
 }
 
-std::string task(std::int64_t offset, std::int64_t length,
-                 std::string const& bucket, std::string const& object, int fd) {
-  auto client = gcs::Client::CreateDefaultClient().value();
-  auto is = client.ReadObject(bucket, object,
-                              gcs::ReadRange(offset, offset + length));
+/// Compute the ranges not covered by @p completed, split into slices.
+std::vector<range> missing_ranges(std::vector<range_checksum> completed,
+                                  std::int64_t object_size,
+                                  std::int64_t minimum_slice_size,
+                                  int thread_count) {
+  std::sort(completed.begin(), completed.end(),
+            [](auto const& a, auto const& b) { return a.offset < b.offset; });
+  std::vector<range> gaps;
+  std::int64_t offset = 0;
+  for (auto const& c : completed) {
+    if (c.offset > offset) gaps.push_back(range{offset, c.offset});
+    offset = (std::max)(offset, c.offset + c.length);
+  }
+  if (offset < object_size) gaps.push_back(range{offset, object_size});
+
+  // Use the same slice size that a new download of the missing bytes would.
+  auto const missing = std::accumulate(
+      gaps.begin(), gaps.end(), std::int64_t{0},
+      [](auto a, auto const& g) { return a + g.end - g.offset; });
+  if (missing == 0) return {};
+  auto const slice_size =
+      compute_slices(missing, minimum_slice_size, thread_count).front();
+  std::vector<range> result;
+  for (auto const& g : gaps) {
+    for (auto o = g.offset; o < g.end; o += slice_size) {
+      result.push_back(range{o, (std::min)(o + slice_size, g.end)});
+    }
+  }
+  return result;
+}
+
+/**
+ * Hands out ranges of the object to a fixed pool of downloader threads.
+ *
+ * The initial ranges come from `compute_slices()`, or from `missing_ranges()`
+ * when resuming a download. Once they are all assigned,
+ * an idle worker splits the active range with the most bytes remaining and
+ * takes its second half. A single slow stream therefore cannot hold up the
+ * download for longer than it takes to transfer `minimum_split_size` bytes.
+ *
+ * Ranges too small to split can still be hedged: if a range has been active
+ * for at least `hedge_delay`, and its throughput is below the
+ * `hedge_percentile` of the completed ranges, an idle worker reads the rest
+ * of the range too. Both workers claim the bytes as they arrive, whichever
+ * gets to the end of the range first completes it, and the other worker stops
+ * after its current read.
+ */
+class slice_scheduler {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  slice_scheduler(std::vector<range> const& ranges, int worker_count,
+                  std::int64_t minimum_split_size, bool work_stealing,
+                  double hedge_percentile,
+                  std::chrono::milliseconds hedge_delay)
+      : pending_(ranges.begin(), ranges.end()),
+        active_(worker_count),
+        minimum_split_size_(minimum_split_size),
+        work_stealing_(work_stealing),
+        hedge_percentile_(hedge_percentile),
+        hedge_delay_(hedge_delay) {}
+
+  /// Return the next range for worker @p id, or `std::nullopt` if none remain.
+  std::optional<range> next(int id) {
+    std::unique_lock<std::mutex> lk(mu_);
+    release(id);
+    while (true) {
+      if (auto r = assign(id)) return r;
+      if (auto r = hedge(id)) return r;
+      // Wait for a range to become slow enough to hedge, or for all the
+      // ranges to complete.
+      if (not may_hedge()) return std::nullopt;
+      cv_.wait_for(lk, kHedgePollInterval);
+    }
+  }
+
+  /// The result of `claim()`.
+  struct claimed {
+    std::int64_t skip;    // bytes at the front of the data already claimed
+    std::int64_t length;  // bytes the worker may write, after `skip`
+    bool done;            // true if the worker's range is now complete
+  };
+
+  /**
+   * Claim @p length bytes, read at @p position, from the range of worker @p id.
+   *
+   * The range may have been split, or partially claimed by a hedged request,
+   * since the worker started reading it. Only the bytes that nobody else has
+   * claimed are granted.
+   */
+  claimed claim(int id, std::int64_t position, std::int64_t length) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto& a = *active_[id];
+    auto const skip = (std::min)(length, a.r.offset - position);
+    auto const n = (std::max)(
+        std::int64_t{0}, (std::min)(position + length, a.r.end) - a.r.offset);
+    a.r.offset += n;
+    a.claimed += n;
+    auto const done = a.r.offset >= a.r.end;
+    if (done && not a.completed) {
+      a.completed = true;
+      throughput_.push_back(throughput(a, clock::now()));
+      cv_.notify_all();
+    }
+    return claimed{skip, n, done};
+  }
+
+  /// The bytes of the range of worker @p id not claimed yet.
+  range current(int id) const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return active_[id]->r;
+  }
+
+  std::int64_t split_count() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return split_count_;
+  }
+
+  std::int64_t hedge_count() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return hedge_count_;
+  }
+
+ private:
+  static auto constexpr kHedgePollInterval = std::chrono::milliseconds(100);
+  // Do not hedge until this many ranges complete, the percentile of a few
+  // samples is not meaningful.
+  static auto constexpr kMinimumHedgeSamples = 4;
+
+  // A range assigned to one worker, or two if the range is hedged.
+  struct assignment {
+    range r;
+    clock::time_point start;
+    std::int64_t claimed = 0;
+    int readers = 1;
+    bool completed = false;
+  };
+
+  static double throughput(assignment const& a, clock::time_point now) {
+    auto const elapsed =
+        std::chrono::duration<double>(now - a.start).count();
+    return elapsed <= 0 ? 0 : static_cast<double>(a.claimed) / elapsed;
+  }
+
+  void release(int id) {
+    auto& a = active_[id];
+    if (a) --a->readers;
+    a.reset();
+    cv_.notify_all();
+  }
+
+  std::optional<range> start(int id, range r) {
+    active_[id] = std::make_shared<assignment>(assignment{r, clock::now()});
+    return r;
+  }
+
+  std::optional<range> assign(int id) {
+    if (not pending_.empty()) {
+      auto const r = pending_.front();
+      pending_.pop_front();
+      return start(id, r);
+    }
+    if (not work_stealing_) return std::nullopt;
+
+    auto remaining = [](auto const& a) {
+      return a ? a->r.end - a->r.offset : std::int64_t{0};
+    };
+    auto victim = std::max_element(active_.begin(), active_.end(),
+                                   [&](auto const& a, auto const& b) {
+                                     return remaining(a) < remaining(b);
+                                   });
+    if (remaining(*victim) < 2 * minimum_split_size_) return std::nullopt;
+    auto& v = (*victim)->r;
+    auto const split = (v.offset + remaining(*victim) / 2) /
+                       kDirectIoAlignment * kDirectIoAlignment;
+    if (split <= v.offset) return std::nullopt;
+    auto const r = range{split, v.end};
+    v.end = split;
+    ++split_count_;
+    return start(id, r);
+  }
+
+  // Return true if an active range may still be hedged.
+  bool may_hedge() const {
+    if (hedge_percentile_ <= 0) return false;
+    return std::any_of(active_.begin(), active_.end(), [](auto const& a) {
+      return a && a->readers == 1 && not a->completed;
+    });
+  }
+
+  std::optional<range> hedge(int id) {
+    if (hedge_percentile_ <= 0) return std::nullopt;
+    if (throughput_.size() < kMinimumHedgeSamples) return std::nullopt;
+    auto sorted = throughput_;
+    auto const n = static_cast<std::size_t>(
+        hedge_percentile_ / 100.0 * static_cast<double>(sorted.size() - 1));
+    std::nth_element(sorted.begin(), sorted.begin() + n, sorted.end());
+    auto const threshold = sorted[n];
+
+    auto const now = clock::now();
+    std::shared_ptr<assignment> slowest;
+    for (auto const& a : active_) {
+      if (not a || a->readers != 1 || a->completed) continue;
+      if (now - a->start < hedge_delay_) continue;
+      if (throughput(*a, now) >= threshold) continue;
+      if (slowest && throughput(*slowest, now) <= throughput(*a, now)) continue;
+      slowest = a;
+    }
+    if (not slowest) return std::nullopt;
+    ++slowest->readers;
+    active_[id] = slowest;
+    ++hedge_count_;
+    return slowest->r;
+  }
+
+  mutable std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<range> pending_;
+  std::vector<std::shared_ptr<assignment>> active_;
+  std::int64_t const minimum_split_size_;
+  bool const work_stealing_;
+  double const hedge_percentile_;
+  std::chrono::milliseconds const hedge_delay_;
+  // The throughput, in bytes per second, of each completed range.
+  std::vector<double> throughput_;
+  std::int64_t split_count_ = 0;
+  std::int64_t hedge_count_ = 0;
+};
+
+/**
+ * Open @p count connections in parallel.
+ *
+ * The client returns each connection to its pool once the request completes,
+ * so the first range requests do not pay for the TLS handshake and connection
+ * setup. Errors are ignored, any real problems surface in the download.
+ */
+void prewarm_connections(gcs::Client client, std::string const& bucket,
+                         std::string const& object, int count) {
+  std::vector<std::future<void>> tasks(count);
+  std::generate(tasks.begin(), tasks.end(), [&] {
+    return std::async(std::launch::async, [&client, &bucket, &object] {
+      (void)client.GetObjectMetadata(bucket, object);
+    });
+  });
+  for (auto& t : tasks) t.get();
+}
+
+struct probe_result {
+  double bandwidth_MiBs;
+  std::chrono::milliseconds time_to_first_byte;
+};
+
+/**
+ * Measure the download bandwidth using @p concurrency streams.
+ *
+ * Each stream reads from a different offset for approximately @p duration,
+ * wrapping around at the end of the object. The data is discarded.
+ */
+probe_result probe(gcs::Client client, std::string const& bucket,
+                   std::string const& object, std::int64_t object_size,
+                   int concurrency, std::chrono::milliseconds duration) {
+  using clock = std::chrono::steady_clock;
+  struct stream_result {
+    std::int64_t bytes;
+    clock::duration time_to_first_byte;
+  };
+  auto const start = clock::now();
+  auto const deadline = start + duration;
+  auto probe_stream = [&](int i) {
+    std::vector<char> buffer(kBufferSize);
+    auto offset = object_size / concurrency * i / kDirectIoAlignment *
+                  kDirectIoAlignment;
+    stream_result result{0, clock::duration::zero()};
+    while (clock::now() < deadline) {
+      auto const request_start = clock::now();
+      auto is = client.ReadObject(bucket, object,
+                                  gcs::ReadRange(offset, object_size));
+      bool first = true;
+      while (clock::now() < deadline) {
+        is.read(buffer.data(), buffer.size());
+        if (first) result.time_to_first_byte = clock::now() - request_start;
+        first = false;
+        if (is.bad() || is.gcount() == 0) break;
+        result.bytes += is.gcount();
+        if (is.eof()) break;
+      }
+      if (is.bad()) break;
+      offset = 0;
+    }
+    return result;
+  };
+  std::vector<std::future<stream_result>> tasks;
+  for (int i = 0; i != concurrency; ++i) {
+    tasks.push_back(std::async(std::launch::async, probe_stream, i));
+  }
+  std::int64_t bytes = 0;
+  auto time_to_first_byte = clock::duration::zero();
+  for (auto& t : tasks) {
+    auto r = t.get();
+    bytes += r.bytes;
+    time_to_first_byte = (std::max)(time_to_first_byte, r.time_to_first_byte);
+  }
+  auto const elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      clock::now() - start);
+  return probe_result{
+      (static_cast<double>(bytes) / kMiB) /
+          (static_cast<double>(elapsed_us.count()) / 1'000'000.0),
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          time_to_first_byte)};
+}
+
+struct tuning {
+  int thread_count;
+  std::int64_t minimum_slice_size;
+};
+
+/**
+ * Find the number of streams where the bandwidth stops improving.
+ *
+ * Run probes with 1, 2, 4, ... streams, up to @p max_thread_count, and stop
+ * once doubling the streams improves the bandwidth by less than 10%. The
+ * minimum slice size is chosen so the time-to-first-byte of each slice is a
+ * small fraction of the time to download it.
+ */
+tuning auto_tune(gcs::Client client, std::string const& bucket,
+                 std::string const& object, std::int64_t object_size,
+                 int max_thread_count, std::chrono::milliseconds duration) {
+  auto constexpr kMinimumImprovement = 1.1;
+  // Download each slice for at least 10 times its time-to-first-byte.
+  auto constexpr kSliceToLatencyRatio = 10;
+  auto constexpr kMinimumSliceSize = 8 * kMiB;
+
+  auto best = probe_result{0, std::chrono::milliseconds(0)};
+  int best_count = 1;
+  for (int count = 1;; count = (std::min)(2 * count, max_thread_count)) {
+    auto const r = probe(client, bucket, object, object_size, count, duration);
+    std::cout << "Auto-tune probe with " << count << " streams: "
+              << fmt::format("{:.2f}", r.bandwidth_MiBs)
+              << " MiB/s, time-to-first-byte " << r.time_to_first_byte.count()
+              << "ms" << std::endl;
+    if (r.bandwidth_MiBs < best.bandwidth_MiBs * kMinimumImprovement) break;
+    best = r;
+    best_count = count;
+    if (count == max_thread_count) break;
+  }
+
+  auto const stream_bytes_per_ms =
+      best.bandwidth_MiBs * kMiB / best_count / 1000.0;
+  auto const latency_ms = static_cast<double>(best.time_to_first_byte.count());
+  auto const slice_size = static_cast<std::int64_t>(
+      stream_bytes_per_ms * latency_ms * kSliceToLatencyRatio);
+  return tuning{best_count,
+                (std::max)(kMinimumSliceSize,
+                           (slice_size + kMiB - 1) / kMiB * kMiB)};
+}
 
-  std::vector<char> buffer(1024 * 1024L);
+struct worker_result {
+  std::string summary;
+  std::vector<range_checksum> checksums;
+};
+
+worker_result worker(int id, slice_scheduler& scheduler, gcs::Client client,
+                     download_journal_writer* journal, transfer_stats& stats,
+                     po::variables_map const& vm, std::int64_t generation,
+                     int fd) {
+  using std::chrono::duration_cast;
+  using std::chrono::microseconds;
+  using std::chrono::milliseconds;
+  stream_done_guard done(stats, id);
+  auto const bucket = vm["bucket"].as<std::string>();
+  auto const object = vm["object"].as<std::string>();
+  auto const range_retries = vm["range-retries"].as<int>();
+  auto engine = make_io_engine(
+      vm["io-engine"].as<std::string>(), vm["destination"].as<std::string>(),
+      fd, kBufferSize, vm["io-queue-depth"].as<int>(),
+      vm["sync-interval"].as<std::int64_t>());
+
+  std::vector<range_checksum> checksums;
+  std::vector<std::int64_t> time_to_first_byte_ms;
+  std::vector<std::string> errors;
   std::int64_t count = 0;
-  std::int64_t write_offset = offset;
-  do {
-    is.read(buffer.data(), buffer.size());
-    if (is.bad()) break;
-    count += is.gcount();
-    check_system_call("pwrite()",
-                      ::pwrite(fd, buffer.data(), is.gcount(), write_offset));
-    write_offset += is.gcount();
-  } while (not is.eof());
-  return fmt::format("Download range [{}, {}] got {}/{} bytes", offset,
-                     offset + length, count, length);
+  std::int64_t retry_count = 0;
+  // The worker has no outstanding read while it waits for a range, or for a
+  // slow range to hedge, do not report it as stalled.
+  auto next_range = [&] {
+    stats.stream_waiting(id, true);
+    auto r = scheduler.next(id);
+    stats.stream_waiting(id, false);
+    return r;
+  };
+  while (auto r = next_range()) {
+    auto const request_start = std::chrono::steady_clock::now();
+    // Pin the generation, so a retry cannot read a newer version of the
+    // object.
+    auto read_range = [&](range const& rr) {
+      return client.ReadObject(bucket, object,
+                               gcs::ReadRange(rr.offset, rr.end),
+                               gcs::Generation(generation));
+    };
+    auto is = read_range(*r);
+    // The offset of the next byte returned by `is`.
+    std::int64_t position = r->offset;
+    std::int64_t write_offset = r->offset;
+    // Compute the checksum while the data is in memory, this saves reading
+    // the destination file again to verify the download.
+    std::uint32_t crc = 0;
+    // Periodically record the bytes written since the last checkpoint, so an
+    // interrupted download can resume close to where it stopped. Without a
+    // journal only the checksum is recorded.
+    std::int64_t checkpoint = r->offset;
+    auto record_checkpoint = [&] {
+      if (write_offset == checkpoint) return;
+      auto const c = range_checksum{checkpoint, write_offset - checkpoint, crc};
+      if (journal != nullptr) {
+        engine->flush();
+        // The journal must not claim data that could be lost in a crash.
+        check_system_call("fdatasync()", ::fdatasync(fd));
+        journal->append(c);
+      }
+      checksums.push_back(c);
+      checkpoint = write_offset;
+      crc = 0;
+    };
+    int attempt = 0;
+    // Restart the request from the first byte not written yet, unless a
+    // hedged request already completed the range. Returns false if the
+    // worker should stop reading the range.
+    auto restart = [&](std::string const& error) {
+      auto const rest = scheduler.current(id);
+      if (rest.offset >= rest.end) return false;
+      if (attempt == range_retries) {
+        errors.push_back(
+            fmt::format("[{}, {}): {}", rest.offset, rest.end, error));
+        return false;
+      }
+      std::this_thread::sleep_for(kRetryBackoff * (1 << attempt));
+      ++attempt;
+      ++retry_count;
+      is = read_range(rest);
+      position = rest.offset;
+      return true;
+    };
+    bool first = true;
+    while (true) {
+      auto* buffer = engine->allocate();
+      auto const read_start = std::chrono::steady_clock::now();
+      is.read(buffer, engine->buffer_size());
+      stats.record_read(id, is.gcount(),
+                        duration_cast<microseconds>(
+                            std::chrono::steady_clock::now() - read_start));
+      if (first) {
+        time_to_first_byte_ms.push_back(
+            duration_cast<milliseconds>(std::chrono::steady_clock::now() -
+                                        request_start)
+                .count());
+      }
+      first = false;
+      if (is.bad()) {
+        engine->release(buffer);
+        if (not restart(is.status().message())) break;
+        continue;
+      }
+      if (is.gcount() != 0) attempt = 0;
+      auto const c = scheduler.claim(id, position, is.gcount());
+      auto const offset = position + c.skip;
+      position += is.gcount();
+      if (c.length == 0) {
+        engine->release(buffer);
+      } else {
+        // A hedged request may have written the bytes in between.
+        if (offset != write_offset) {
+          record_checkpoint();
+          write_offset = checkpoint = offset;
+        }
+        if (c.skip != 0) std::memmove(buffer, buffer + c.skip, c.length);
+        crc = crc32c::Extend(crc, reinterpret_cast<std::uint8_t*>(buffer),
+                             c.length);
+        engine->write(buffer, c.length, write_offset);
+        write_offset += c.length;
+        count += c.length;
+      }
+      if (c.done) break;
+      // A stream that ends before the range is complete, without an error,
+      // is retried too.
+      if (is.eof()) {
+        if (not restart("unexpected end of stream")) break;
+        continue;
+      }
+      if (write_offset - checkpoint >= kJournalInterval) record_checkpoint();
+    }
+    record_checkpoint();
+  }
+  auto summary = fmt::format(
+      "Worker {} downloaded {} bytes in {} ranges, {} retries, "
+      "time-to-first-byte [{}]ms",
+      id, count, checksums.size(), retry_count,
+      fmt::join(time_to_first_byte_ms, ", "));
+  for (auto const& e : errors) {
+    summary += fmt::format("\nWorker {} gave up on range {}", id, e);
+  }
+  return worker_result{std::move(summary), std::move(checksums)};
 }
 
-using ::gcs_fast_transfers::file_info;
+using ::gcs_fast_transfers::combine_checksums;
 using ::gcs_fast_transfers::format_size;
-using ::gcs_fast_transfers::kMiB;
+using ::gcs_fast_transfers::load_download_journal;
+using ::gcs_fast_transfers::parallel_file_info;
+
+/**
+ * Reassembles the data from parallel range readers in offset order.
+ *
+ * Readers block in `push()` while their data starts `window` bytes or more
+ * past the data already written. The readers furthest ahead stop first, and
+ * the reassembly buffers are bounded to approximately `window` bytes. Written
+ * buffers are recycled, rather than returned to the allocator.
+ */
+class ordered_writer {
+ public:
+  ordered_writer(std::int64_t size, std::int64_t window)
+      : size_(size), window_(window) {}
+
+  /// Get an empty buffer, of `kBufferSize` bytes.
+  std::vector<char> get_buffer() {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (free_.empty()) return std::vector<char>(kBufferSize);
+    auto b = std::move(free_.back());
+    free_.pop_back();
+    b.resize(kBufferSize);
+    return b;
+  }
+
+  /// Queue the data at @p offset, returns false if the download was cancelled.
+  bool push(std::int64_t offset, std::vector<char> buffer) {
+    std::unique_lock<std::mutex> lk(mu_);
+    cv_.wait(lk, [&] { return cancelled_ || offset < written_ + window_; });
+    if (cancelled_) return false;
+    ready_.emplace(offset, std::move(buffer));
+    cv_.notify_all();
+    return true;
+  }
+
+  /// Get the next buffer in offset order, or std::nullopt at the end.
+  std::optional<std::vector<char>> pop() {
+    std::unique_lock<std::mutex> lk(mu_);
+    if (written_ == size_) return std::nullopt;
+    cv_.wait(lk, [&] {
+      return not error_.empty() || ready_.count(written_) != 0;
+    });
+    if (not error_.empty()) throw std::runtime_error(error_);
+    auto node = ready_.extract(written_);
+    written_ += static_cast<std::int64_t>(node.mapped().size());
+    cv_.notify_all();
+    return std::move(node.mapped());
+  }
+
+  void recycle(std::vector<char> buffer) {
+    std::lock_guard<std::mutex> lk(mu_);
+    free_.push_back(std::move(buffer));
+  }
+
+  /// Stop all readers, and make the writer fail with @p error.
+  void cancel(std::string error) {
+    std::lock_guard<std::mutex> lk(mu_);
+    cancelled_ = true;
+    if (error_.empty()) error_ = std::move(error);
+    cv_.notify_all();
+  }
+
+ private:
+  std::int64_t const size_;
+  std::int64_t const window_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::map<std::int64_t, std::vector<char>> ready_;
+  std::vector<std::vector<char>> free_;
+  std::int64_t written_ = 0;
+  bool cancelled_ = false;
+  std::string error_;
+};
+
+void stream_reader(int id, gcs::Client client, ordered_writer& writer,
+                   transfer_stats& stats, std::atomic<std::int64_t>& next_slice,
+                   std::string const& bucket, std::string const& object,
+                   std::int64_t generation, std::int64_t object_size,
+                   std::int64_t slice_size, int range_retries) {
+  stream_done_guard done(stats, id);
+  // The writer waits for the data of each slice, it must learn about any
+  // failure, or it would wait forever.
+  try {
+    // Hand out the slices in offset order, so the active readers are always
+    // close to the data being written.
+    for (auto offset = slice_size * next_slice++; offset < object_size;
+         offset = slice_size * next_slice++) {
+      auto const end = (std::min)(offset + slice_size, object_size);
+      auto read_range = [&] {
+        return client.ReadObject(bucket, object, gcs::ReadRange(offset, end),
+                                 gcs::Generation(generation));
+      };
+      auto is = read_range();
+      int attempt = 0;
+      while (offset < end) {
+        auto buffer = writer.get_buffer();
+        auto const read_start = std::chrono::steady_clock::now();
+        is.read(buffer.data(), buffer.size());
+        stats.record_read(id, is.gcount(),
+                          std::chrono::duration_cast<std::chrono::microseconds>(
+                              std::chrono::steady_clock::now() - read_start));
+        if (is.bad() && attempt != range_retries) {
+          // Restart the request from the first byte not received yet.
+          writer.recycle(std::move(buffer));
+          std::this_thread::sleep_for(kRetryBackoff * (1 << attempt));
+          ++attempt;
+          is = read_range();
+          continue;
+        }
+        if (is.bad() || is.gcount() == 0) {
+          return writer.cancel(fmt::format("error reading range [{}, {}]: {}",
+                                           offset, end, is.status().message()));
+        }
+        attempt = 0;
+        buffer.resize(is.gcount());
+        auto const o = offset;
+        offset += is.gcount();
+        // Blocking for the writer to catch up is not a stall either.
+        stats.stream_waiting(id, true);
+        auto const pushed = writer.push(o, std::move(buffer));
+        stats.stream_waiting(id, false);
+        if (not pushed) return;
+      }
+    }
+  } catch (std::exception const& ex) {
+    writer.cancel(fmt::format("error in reader {}: {}", id, ex.what()));
+    throw;
+  } catch (...) {
+    writer.cancel(fmt::format("unknown error in reader {}", id));
+    throw;
+  }
+}
+
+void write_all(int fd, char const* data, std::size_t size) {
+  while (size != 0) {
+    auto const n = ::write(fd, data, size);
+    if (n < 0 && errno == EINTR) continue;
+    check_system_call("write()", static_cast<int>(n));
+    data += n;
+    size -= n;
+  }
+}
+
+/**
+ * Download an object to stdout, reading multiple ranges in parallel.
+ *
+ * All the progress reports go to stderr, so the data can be piped into other
+ * programs.
+ */
+int stream_download(gcs::Client client, gcs::ObjectMetadata const& metadata,
+                    po::variables_map const& vm) {
+  auto const bucket = vm["bucket"].as<std::string>();
+  auto const object = vm["object"].as<std::string>();
+  auto const object_size = static_cast<std::int64_t>(metadata.size());
+  auto const slice_size = vm["stream-slice-size"].as<std::int64_t>();
+  auto const slice_count = (object_size + slice_size - 1) / slice_size;
+  auto const reader_count = static_cast<int>((std::min<std::int64_t>)(
+      slice_count, vm["thread-count"].as<int>()));
+
+  std::cerr << "Streaming " << object << " from bucket " << bucket
+            << " to stdout\n";
+  std::cerr << "This object size is approximately "
+            << format_size(object_size) << ". It will be downloaded in "
+            << slice_count << " slices, using " << reader_count
+            << " readers." << std::endl;
+
+  auto const start = std::chrono::steady_clock::now();
+  ordered_writer writer(object_size, vm["memory-limit"].as<std::int64_t>());
+  transfer_stats stats(reader_count);
+  auto reporter = make_progress_reporter(stats, std::cerr, vm);
+  std::atomic<std::int64_t> next_slice{0};
+  std::vector<std::future<void>> tasks(reader_count);
+  int id = 0;
+  std::generate(tasks.begin(), tasks.end(), [&] {
+    return std::async(std::launch::async, stream_reader, id++, client,
+                      std::ref(writer), std::ref(stats), std::ref(next_slice),
+                      bucket, object, metadata.generation(), object_size,
+                      slice_size, vm["range-retries"].as<int>());
+  });
+
+  // The data arrives in order, so the checksum is a single running CRC32C.
+  std::uint32_t crc = 0;
+  std::int64_t size = 0;
+  try {
+    while (auto buffer = writer.pop()) {
+      write_all(STDOUT_FILENO, buffer->data(), buffer->size());
+      crc = crc32c::Extend(crc, reinterpret_cast<std::uint8_t*>(buffer->data()),
+                           buffer->size());
+      size += static_cast<std::int64_t>(buffer->size());
+      writer.recycle(*std::move(buffer));
+    }
+  } catch (...) {
+    writer.cancel("error writing to stdout");
+    for (auto& t : tasks) t.get();
+    throw;
+  }
+  for (auto& t : tasks) t.get();
+  reporter.reset();
+
+  auto const end = std::chrono::steady_clock::now();
+  write_stats_json(stats, vm, end);
+  auto const elapsed_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+  auto const elapsed_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+  auto const effective_bandwidth_MiBs =
+      (static_cast<double>(size) / kMiB) / (elapsed_us.count() / 1'000'000.0);
+  std::cerr << "Download completed in " << elapsed_ms.count() << "ms\n"
+            << "Effective bandwidth " << effective_bandwidth_MiBs << " MiB/s\n";
+
+  if (size != object_size) {
+    std::cerr << "Downloaded size mismatch, expected=" << object_size
+              << ", got=" << size << std::endl;
+    return 1;
+  }
+  if (gcs_fast_transfers::format_crc32c(crc) != metadata.crc32c()) {
+    std::cerr << "Download CRC32C mismatch, expected=" << metadata.crc32c()
+              << ", got=" << gcs_fast_transfers::format_crc32c(crc)
+              << std::endl;
+    return 1;
+  }
+  std::cerr << "Size and CRC32C match expected values" << std::endl;
+  return 0;
+}
 
 }  // namespace
 
@@ -87,47 +851,161 @@ int main(int argc, char* argv[]) try {
   auto const object = vm["object"].as<std::string>();
   auto const destination = vm["destination"].as<std::string>();
 
-  auto client = gcs::Client::CreateDefaultClient().value();
+  // Share a single client, and its connection pool, across all the workers.
+  auto const setup_start = std::chrono::steady_clock::now();
+  auto client = gcs::Client(
+      google::cloud::Options{}.set<gcs::ConnectionPoolSizeOption>(
+          vm["connection-pool-size"].as<int>()));
   auto metadata = client.GetObjectMetadata(bucket, object).value();
+  if (destination == "-") return stream_download(client, metadata, vm);
+  std::cout << "Created client and fetched object metadata in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - setup_start)
+                   .count()
+            << "ms\n";
 
-  auto slices = compute_slices(metadata.size(), vm);
+  auto const object_size = static_cast<std::int64_t>(metadata.size());
+  auto thread_count = vm["thread-count"].as<int>();
+  auto minimum_slice_size = vm["minimum-slice-size"].as<std::int64_t>();
+  if (vm["auto-tune"].as<bool>() && object_size > 0) {
+    auto const t = auto_tune(
+        client, bucket, object, object_size, thread_count,
+        std::chrono::milliseconds(vm["auto-tune-duration"].as<int>()));
+    thread_count = t.thread_count;
+    minimum_slice_size = t.minimum_slice_size;
+    std::cout << "Auto-tune selected --thread-count=" << thread_count
+              << " --minimum-slice-size=" << minimum_slice_size << std::endl;
+  }
+  auto const journal_name = destination + ".journal";
+  // The checksums of the data already in the destination file.
+  std::vector<range_checksum> checksums;
+  auto const resume = [&] {
+    if (not vm["resume"].as<bool>()) return false;
+    auto journal = load_download_journal(journal_name);
+    if (not journal) {
+      std::cout << "No journal found in " << journal_name
+                << ", starting a new download" << std::endl;
+      return false;
+    }
+    if (journal->generation != metadata.generation() ||
+        journal->size != object_size) {
+      std::cout << "The object has changed since the interrupted download,"
+                << " starting a new download" << std::endl;
+      return false;
+    }
+    auto const journaled_end = std::accumulate(
+        journal->ranges.begin(), journal->ranges.end(), std::int64_t{0},
+        [](auto a, auto const& r) {
+          return (std::max)(a, r.offset + r.length);
+        });
+    struct stat st {};
+    if (::stat(destination.c_str(), &st) != 0 || st.st_size < journaled_end ||
+        st.st_size > object_size) {
+      std::cout << "The destination file is missing or does not match the"
+                << " journal, starting a new download" << std::endl;
+      return false;
+    }
+    // The file may have changed since the journal was written, only keep
+    // the ranges that still match their checksum.
+    auto const journaled_count = journal->ranges.size();
+    checksums = remove_overlaps(verify_ranges(
+        destination, std::move(journal->ranges), thread_count));
+    if (checksums.size() != journaled_count) {
+      std::cout << "Downloading again " << journaled_count - checksums.size()
+                << " journaled ranges that do not match the destination file,"
+                << " or overlap other ranges" << std::endl;
+    }
+    return true;
+  }();
+  auto const ranges =
+      resume ? missing_ranges(checksums, object_size, minimum_slice_size,
+                              thread_count)
+             : to_ranges(compute_slices(object_size, minimum_slice_size,
+                                        thread_count));
+  auto const downloaded_size = std::accumulate(
+      checksums.begin(), checksums.end(), std::int64_t{0},
+      [](auto a, auto const& c) { return a + c.length; });
 
   std::cout << "Downloading " << object << " from bucket " << bucket
             << " to file " << destination << "\n";
+  if (resume) {
+    std::cout << "Resuming download, approximately "
+              << format_size(downloaded_size) << " already downloaded.\n";
+  }
   std::cout << "This object size is approximately "
             << format_size(metadata.size()) << ". It will be downloaded in "
-            << slices.size() << " slices." << std::endl;
+            << ranges.size() << " slices." << std::endl;
 
   auto const start = std::chrono::steady_clock::now();
-  auto constexpr kOpenFlags = O_CREAT | O_TRUNC | O_WRONLY;
   auto constexpr kOpenMode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
+  auto const open_flags = resume ? O_CREAT | O_WRONLY
+                                 : O_CREAT | O_TRUNC | O_WRONLY;
   auto const fd = check_system_call(
-      "open()", ::open(destination.c_str(), kOpenFlags, kOpenMode));
+      "open()", ::open(destination.c_str(), open_flags, kOpenMode));
+  // Set the file size before the workers start, so their writes do not
+  // extend the file out of order.
+  auto const preallocated =
+      preallocate(fd, object_size, vm["preallocate"].as<std::string>());
+  std::cout << "Preallocated the destination file using " << preallocated
+            << std::endl;
+  // Only journal the download if it may be resumed, the journal syncs the
+  // data to disk before recording it.
+  std::optional<download_journal_writer> journal;
+  if (vm["resume"].as<bool>()) {
+    journal.emplace(journal_name, metadata.generation(), object_size, resume);
+  }
 
-  std::vector<std::future<std::string>> tasks(slices.size());
-  std::int64_t offset = 0;
-  std::transform(slices.begin(), slices.end(), tasks.begin(), [&](auto length) {
-    auto f = std::async(std::launch::async, task, offset, length, bucket,
-                        object, fd);
-    offset += length;
-    return f;
+  auto const worker_count = static_cast<int>((std::min)(
+      ranges.size(), static_cast<std::size_t>(thread_count)));
+  auto const prewarm_count = vm.count("prewarm-connections") != 0
+                                 ? vm["prewarm-connections"].as<int>()
+                                 : worker_count;
+  if (prewarm_count > 0) {
+    auto const prewarm_start = std::chrono::steady_clock::now();
+    prewarm_connections(client, bucket, object, prewarm_count);
+    std::cout << "Pre-warmed " << prewarm_count << " connections in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::steady_clock::now() - prewarm_start)
+                     .count()
+              << "ms" << std::endl;
+  }
+  slice_scheduler scheduler(
+      ranges, worker_count, vm["minimum-split-size"].as<std::int64_t>(),
+      vm["work-stealing"].as<bool>(), vm["hedge-percentile"].as<double>(),
+      std::chrono::milliseconds(vm["hedge-delay"].as<int>()));
+  transfer_stats stats(worker_count);
+  auto reporter = make_progress_reporter(stats, std::cout, vm);
+  std::vector<std::future<worker_result>> tasks(worker_count);
+  int id = 0;
+  std::generate(tasks.begin(), tasks.end(), [&] {
+    return std::async(std::launch::async, worker, id++, std::ref(scheduler),
+                      client, journal ? &*journal : nullptr, std::ref(stats),
+                      std::cref(vm), metadata.generation(), fd);
   });
 
-  for (auto& t : tasks) std::cout << t.get() << "\n";
+  for (auto& t : tasks) {
+    auto r = t.get();
+    std::cout << r.summary << "\n";
+    checksums.insert(checksums.end(), r.checksums.begin(), r.checksums.end());
+  }
+  reporter.reset();
   check_system_call("close(fd)", ::close(fd));
+  std::cout << "Ranges split between workers: " << scheduler.split_count()
+            << "\nHedged range requests: " << scheduler.hedge_count() << "\n";
 
   auto const end = std::chrono::steady_clock::now();
+  write_stats_json(stats, vm, end);
   auto const elapsed_us =
       std::chrono::duration_cast<std::chrono::microseconds>(end - start);
   auto const elapsed_ms =
       std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
   auto const effective_bandwidth_MiBs =
-      (static_cast<double>(metadata.size()) / kMiB) /
+      (static_cast<double>(object_size - downloaded_size) / kMiB) /
       (elapsed_us.count() / 1'000'000.0);
   std::cout << "Download completed in " << elapsed_ms.count() << "ms\n"
             << "Effective bandwidth " << effective_bandwidth_MiBs << " MiB/s\n";
 
-  auto [size, crc32c] = file_info(destination);
+  auto [size, crc32c] = combine_checksums(std::move(checksums));
   if (size != metadata.size()) {
     std::cout << "Downloaded file size mismatch, expected=" << metadata.size()
               << ", got=" << size << std::endl;
@@ -141,6 +1019,27 @@ int main(int argc, char* argv[]) try {
   }
 
   std::cout << "File size and CRC32C match expected values" << std::endl;
+  std::remove(journal_name.c_str());
+
+  if (vm["verify-destination"].as<bool>()) {
+    // The checksums above are computed from the data received, re-reading the
+    // file also detects any problems writing it.
+    auto const verify_start = std::chrono::steady_clock::now();
+    auto [file_size, file_crc32c] =
+        parallel_file_info(destination, thread_count);
+    auto const verify_ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - verify_start);
+    if (file_size != object_size || file_crc32c != metadata.crc32c()) {
+      std::cout << "Destination file mismatch, expected size="
+                << metadata.size() << ", crc32c=" << metadata.crc32c()
+                << ", got size=" << file_size << ", crc32c=" << file_crc32c
+                << std::endl;
+      return 1;
+    }
+    std::cout << "Destination file verified in " << verify_ms.count() << "ms"
+              << std::endl;
+  }
 
   return 0;
 } catch (std::exception const& ex) {
@@ -152,6 +1051,9 @@ int main(int argc, char* argv[]) try {
 }
 
 namespace {
+using ::gcs_fast_transfers::io_engine_supported;
+using ::gcs_fast_transfers::preallocate_supported;
+
 char const* kPositional[] = {"bucket", "object", "destination"};
 
 [[noreturn]] void usage(std::string const& argv0,
@@ -179,6 +1081,9 @@ char const* kPositional[] = {"bucket", "object", "destination"};
 
 po::variables_map parse_command_line(int argc, char* argv[]) {
   auto const default_minimum_slice_size = 64 * 1024 * 1024L;
+  auto const default_minimum_split_size = 8 * 1024 * 1024L;
+  auto const default_stream_slice_size = 8 * 1024 * 1024L;
+  auto const default_memory_limit = 256 * 1024 * 1024L;
   auto const default_thread_count = [] {
     auto constexpr kFallbackThreadCount = 2;
     auto constexpr kThreadsPerCore = 2;
@@ -200,14 +1105,97 @@ po::variables_map parse_command_line(int argc, char* argv[]) {
        "set the GCS object to download")
       //
       ("destination", po::value<std::string>()->required(),
-       "set the destination file to download into")
+       "set the destination file to download into, use `-` to stream the "
+       "object to stdout")
       //
       ("thread-count", po::value<int>()->default_value(default_thread_count),
        "number of parallel streams for the download")
       //
       ("minimum-slice-size",
        po::value<std::int64_t>()->default_value(default_minimum_slice_size),
-       "minimum slice size");
+       "minimum slice size")
+      //
+      ("auto-tune", po::value<bool>()->default_value(false),
+       "probe the bandwidth with increasing numbers of streams, up to "
+       "--thread-count, and pick the thread count and minimum slice size "
+       "before starting the download")
+      //
+      ("auto-tune-duration", po::value<int>()->default_value(1000),
+       "the duration of each auto-tune probe, in milliseconds")
+      //
+      ("minimum-split-size",
+       po::value<std::int64_t>()->default_value(default_minimum_split_size),
+       "idle workers only split ranges with at least twice this many bytes "
+       "remaining")
+      //
+      ("work-stealing", po::value<bool>()->default_value(true),
+       "let idle workers split the largest remaining range, disable to "
+       "compare against static slicing")
+      //
+      ("hedge-percentile", po::value<double>()->default_value(0),
+       "start a second request for ranges slower than this percentile of "
+       "the completed ranges, use 0 to disable hedged requests")
+      //
+      ("hedge-delay", po::value<int>()->default_value(2000),
+       "only hedge ranges active for at least this many milliseconds")
+      //
+      ("range-retries", po::value<int>()->default_value(3),
+       "restart a failed range request from the last byte received up to "
+       "this many times")
+      //
+      ("io-engine", po::value<std::string>()->default_value("pwrite"),
+       "how to write the destination file: `pwrite`, `odirect` (bypass the "
+       "page cache), or `uring` (batched io_uring with O_DIRECT)")
+      //
+      ("io-queue-depth", po::value<int>()->default_value(8),
+       "number of buffers, and writes in flight, per thread with "
+       "--io-engine=uring")
+      //
+      ("preallocate", po::value<std::string>()->default_value("fallocate"),
+       "how to size the destination file before the download: `none`, "
+       "`sparse`, or `fallocate` (also allocate the blocks)")
+      //
+      ("sync-interval", po::value<std::int64_t>()->default_value(0),
+       "with --io-engine=pwrite, start the write-back of each block of this "
+       "many bytes as soon as it is written, use 0 to leave the write-back "
+       "to the kernel")
+      //
+      ("connection-pool-size",
+       po::value<int>()->default_value(default_thread_count),
+       "maximum number of idle connections kept by the shared client")
+      //
+      ("prewarm-connections", po::value<int>(),
+       "number of connections to open before the first range request, "
+       "defaults to the number of threads used in the download")
+      //
+      ("resume", po::value<bool>()->default_value(false),
+       "record the progress in a journal file next to the destination, and "
+       "continue an interrupted download, only downloading the missing "
+       "ranges")
+      //
+      ("verify-destination", po::value<bool>()->default_value(false),
+       "after the download, read back the destination file and verify its "
+       "size and CRC32C checksum")
+      //
+      ("stream-slice-size",
+       po::value<std::int64_t>()->default_value(default_stream_slice_size),
+       "size of the ranges read in parallel when streaming to stdout")
+      //
+      ("progress-interval", po::value<int>()->default_value(5),
+       "print the aggregate and per-stream bandwidth every this many "
+       "seconds, use 0 to disable the progress reports")
+      //
+      ("stall-timeout", po::value<int>()->default_value(10),
+       "report streams that receive no data for this many seconds as stalled")
+      //
+      ("stats-json", po::value<std::string>(),
+       "write the bandwidth, per-stream throughput, and read latency "
+       "histograms to this file, in JSON format")
+      //
+      ("memory-limit",
+       po::value<std::int64_t>()->default_value(default_memory_limit),
+       "approximate limit for the data buffered when streaming to stdout, "
+       "readers further ahead than this wait for the data to be written");
 
   // parse the input into the map
   po::variables_map vm;
@@ -239,6 +1227,62 @@ po::variables_map parse_command_line(int argc, char* argv[]) {
   if (vm["minimum-slice-size"].as<std::int64_t>() == 0) {
     usage(argv[0], desc, "the --minimum-slice-size option cannot be zero");
   }
+  if (vm["minimum-split-size"].as<std::int64_t>() <= 0) {
+    usage(argv[0], desc, "the --minimum-split-size option must be positive");
+  }
+  auto const hedge_percentile = vm["hedge-percentile"].as<double>();
+  if (hedge_percentile < 0 || hedge_percentile > 100) {
+    usage(argv[0], desc, "the --hedge-percentile option must be in [0, 100]");
+  }
+  if (vm["hedge-delay"].as<int>() < 0) {
+    usage(argv[0], desc, "the --hedge-delay option cannot be negative");
+  }
+  if (vm["range-retries"].as<int>() < 0) {
+    usage(argv[0], desc, "the --range-retries option cannot be negative");
+  }
+  auto const engine = vm["io-engine"].as<std::string>();
+  if (not io_engine_supported(engine)) {
+    usage(argv[0], desc, fmt::format("unsupported --io-engine {}", engine));
+  }
+  if (vm["io-queue-depth"].as<int>() <= 0) {
+    usage(argv[0], desc, "the --io-queue-depth option must be positive");
+  }
+  auto const method = vm["preallocate"].as<std::string>();
+  if (not preallocate_supported(method)) {
+    usage(argv[0], desc, fmt::format("unsupported --preallocate {}", method));
+  }
+  if (vm["sync-interval"].as<std::int64_t>() < 0) {
+    usage(argv[0], desc, "the --sync-interval option cannot be negative");
+  }
+  if (vm["connection-pool-size"].as<int>() <= 0) {
+    usage(argv[0], desc, "the --connection-pool-size option must be positive");
+  }
+  if (vm["stream-slice-size"].as<std::int64_t>() <= 0) {
+    usage(argv[0], desc, "the --stream-slice-size option must be positive");
+  }
+  if (vm["progress-interval"].as<int>() < 0) {
+    usage(argv[0], desc, "the --progress-interval option cannot be negative");
+  }
+  if (vm["stall-timeout"].as<int>() <= 0) {
+    usage(argv[0], desc, "the --stall-timeout option must be positive");
+  }
+  if (vm["memory-limit"].as<std::int64_t>() <= 0) {
+    usage(argv[0], desc, "the --memory-limit option must be positive");
+  }
+  if (vm["auto-tune-duration"].as<int>() <= 0) {
+    usage(argv[0], desc, "the --auto-tune-duration option must be positive");
+  }
+  if (vm["destination"].as<std::string>() == "-" &&
+      vm["auto-tune"].as<bool>()) {
+    usage(argv[0], desc, "cannot use --auto-tune when streaming to stdout");
+  }
+  if (vm["destination"].as<std::string>() == "-" && vm["resume"].as<bool>()) {
+    usage(argv[0], desc, "cannot use --resume when streaming to stdout");
+  }
+  if (vm.count("prewarm-connections") != 0 &&
+      vm["prewarm-connections"].as<int>() < 0) {
+    usage(argv[0], desc, "the --prewarm-connections option cannot be negative");
+  }
 
   return vm;
 }
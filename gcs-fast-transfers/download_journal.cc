@@ -0,0 +1,80 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "download_journal.h"
+#include <sstream>
+#include <stdexcept>
+
+namespace gcs_fast_transfers {
+namespace {
+// The journal is a text file. The first line identifies the object, and each
+// following line records a completed range as `offset length crc32c end`, with
+// the checksum in hex. The `end` marker detects records torn by a crash.
+auto constexpr kJournalHeader = "gcs-fast-transfers-download-journal-v1";
+auto constexpr kRecordEnd = "end";
+}  // namespace
+
+std::optional<download_journal> load_download_journal(
+    std::string const& filename) {
+  std::ifstream is(filename);
+  std::string line;
+  if (not std::getline(is, line)) return std::nullopt;
+
+  std::istringstream header(line);
+  std::string tag;
+  download_journal journal{0, 0, {}};
+  if (not(header >> tag >> journal.generation >> journal.size) ||
+      tag != kJournalHeader) {
+    return std::nullopt;
+  }
+  while (std::getline(is, line)) {
+    std::istringstream record(line);
+    range_checksum r{0, 0, 0};
+    std::string end;
+    if (not(record >> r.offset >> r.length >> std::hex >> r.crc32c >> end) ||
+        end != kRecordEnd) {
+      continue;
+    }
+    if (r.offset < 0 || r.length <= 0 || r.offset + r.length > journal.size) {
+      continue;
+    }
+    journal.ranges.push_back(r);
+  }
+  return journal;
+}
+
+download_journal_writer::download_journal_writer(std::string const& filename,
+                                                 std::int64_t generation,
+                                                 std::int64_t size,
+                                                 bool resume)
+    : os_(filename, resume ? std::ios::app : std::ios::trunc) {
+  if (not os_) {
+    throw std::runtime_error("cannot open download journal " + filename);
+  }
+  // Terminate any record torn when the previous download was interrupted.
+  if (resume) {
+    os_ << std::endl;
+    return;
+  }
+  os_ << kJournalHeader << ' ' << generation << ' ' << size << std::endl;
+}
+
+void download_journal_writer::append(range_checksum const& r) {
+  std::lock_guard<std::mutex> lk(mu_);
+  os_ << r.offset << ' ' << r.length << ' ' << std::hex << r.crc32c
+      << std::dec << ' ' << kRecordEnd << std::endl;
+  if (not os_) throw std::runtime_error("error writing download journal");
+}
+
+}  // namespace gcs_fast_transfers
@@ -0,0 +1,63 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GCS_FAST_TRANSFERS_DOWNLOAD_JOURNAL_H
+#define GCS_FAST_TRANSFERS_DOWNLOAD_JOURNAL_H
+
+#include "gcs_fast_transfers.h"
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace gcs_fast_transfers {
+
+// The contents of a download journal.
+struct download_journal {
+  std::int64_t generation;
+  std::int64_t size;
+  std::vector<range_checksum> ranges;
+};
+
+// Load a journal, returns std::nullopt if the file does not exist or has an
+// invalid header. A truncated last record, as left by an interrupted write,
+// is ignored.
+std::optional<download_journal> load_download_journal(
+    std::string const& filename);
+
+/**
+ * Records the ranges of an object already written to the destination file.
+ *
+ * Each record is flushed to the kernel as soon as it is appended, so it
+ * survives if the process is killed. Appending records is thread-safe.
+ */
+class download_journal_writer {
+ public:
+  // Append to an existing journal if @p resume is true, otherwise start a new
+  // journal for the given object generation and size.
+  download_journal_writer(std::string const& filename, std::int64_t generation,
+                          std::int64_t size, bool resume);
+
+  void append(range_checksum const& r);
+
+ private:
+  std::mutex mu_;
+  std::ofstream os_;
+};
+
+}  // namespace gcs_fast_transfers
+
+#endif  // GCS_FAST_TRANSFERS_DOWNLOAD_JOURNAL_H
@@ -0,0 +1,123 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gcs_fast_transfers.h"
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using ::gcs_fast_transfers::file_info;
+using ::gcs_fast_transfers::kGiB;
+using ::gcs_fast_transfers::kMiB;
+using ::gcs_fast_transfers::parallel_file_info;
+
+// The files are created the first time a benchmark needs them, so filtering
+// out the large sizes with `--benchmark_filter` also skips creating them.
+std::map<std::int64_t, std::string>& test_files() {
+  static auto* files = new std::map<std::int64_t, std::string>;
+  return *files;
+}
+
+std::string const& test_file(std::int64_t size) {
+  auto& files = test_files();
+  auto l = files.find(size);
+  if (l != files.end()) return l->second;
+
+  auto filename = "file-info-benchmark-" + std::to_string(size) + ".bin";
+  std::vector<char> block(kMiB);
+  std::generate(block.begin(), block.end(),
+                [g = std::mt19937_64(std::random_device{}())]() mutable {
+                  return static_cast<char>(g());
+                });
+  std::ofstream os(filename, std::ios::binary | std::ios::trunc);
+  for (std::int64_t offset = 0; offset < size; offset += kMiB) {
+    os.write(block.data(), (std::min)(kMiB, size - offset));
+  }
+  os.close();
+  if (not os) throw std::runtime_error("cannot create " + filename);
+  return files.emplace(size, std::move(filename)).first->second;
+}
+
+void BM_FileInfo(benchmark::State& state) {
+  auto const& filename = test_file(state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(file_info(filename));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+
+void BM_ParallelFileInfo(benchmark::State& state) {
+  auto const& filename = test_file(state.range(0));
+  auto const thread_count = static_cast<int>(state.range(1));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(parallel_file_info(filename, thread_count));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+
+// The file sizes, from 1MiB to 64GiB.
+std::vector<std::int64_t> file_sizes() {
+  std::vector<std::int64_t> sizes;
+  for (auto size = kMiB; size < 64 * kGiB; size *= 8) sizes.push_back(size);
+  sizes.push_back(64 * kGiB);
+  return sizes;
+}
+
+void file_info_arguments(benchmark::internal::Benchmark* b) {
+  for (auto size : file_sizes()) b->Args({size});
+}
+
+void parallel_file_info_arguments(benchmark::internal::Benchmark* b) {
+  auto const cores = static_cast<std::int64_t>(
+      (std::max)(1U, std::thread::hardware_concurrency()));
+  for (auto size : file_sizes()) {
+    for (std::int64_t threads = 2; threads < cores; threads *= 2) {
+      b->Args({size, threads});
+    }
+    b->Args({size, cores});
+  }
+}
+
+BENCHMARK(BM_FileInfo)
+    ->Apply(file_info_arguments)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+BENCHMARK(BM_ParallelFileInfo)
+    ->Apply(parallel_file_info_arguments)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  for (auto const& [size, filename] : test_files()) {
+    std::remove(filename.c_str());
+  }
+  return 0;
+}
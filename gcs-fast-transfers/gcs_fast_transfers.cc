@@ -13,14 +13,79 @@
 // limitations under the License.
 
 #include "gcs_fast_transfers.h"
+#include "io_engine.h"
 #include <boost/endian/buffers.hpp>
 #include <cppcodec/base64_rfc4648.hpp>
 #include <crc32c/crc32c.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
 #include <fstream>
+#include <future>
+#include <iterator>
 #include <limits>
+#include <stdexcept>
 #include <vector>
+// Posix headers last.
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace gcs_fast_transfers {
+namespace {
+
+// The CRC32C (Castagnoli) polynomial, in reversed bit order.
+auto constexpr kCrc32cPolynomial = std::uint32_t{0x82F63B78};
+
+using gf2_matrix = std::array<std::uint32_t, 32>;
+
+std::uint32_t gf2_matrix_times(gf2_matrix const& mat, std::uint32_t vec) {
+  std::uint32_t sum = 0;
+  for (auto i = mat.begin(); vec != 0; vec >>= 1, ++i) {
+    if (vec & 1) sum ^= *i;
+  }
+  return sum;
+}
+
+gf2_matrix gf2_matrix_square(gf2_matrix const& mat) {
+  gf2_matrix square;
+  std::transform(mat.begin(), mat.end(), square.begin(),
+                 [&mat](auto row) { return gf2_matrix_times(mat, row); });
+  return square;
+}
+
+std::int64_t check_system_call(std::string const& name, std::int64_t result) {
+  if (result >= 0) return result;
+  auto err = errno;
+  throw std::runtime_error("Error in " + name + "() - return value=" +
+                           std::to_string(result) + ", error=[" +
+                           std::to_string(err) + "] " + strerror(err));
+}
+
+// Compute the checksum of `[offset, offset + length)`. If the file is shorter
+// than expected the result only covers the bytes actually read.
+range_checksum checksum_range(int fd, std::int64_t offset,
+                              std::int64_t length) {
+  std::vector<char> buffer(1024 * 1024L);
+  range_checksum result{offset, 0, 0};
+  while (result.length < length) {
+    auto const n = check_system_call(
+        "pread", ::pread(fd, buffer.data(),
+                         (std::min)(static_cast<std::int64_t>(buffer.size()),
+                                    length - result.length),
+                         offset + result.length));
+    if (n == 0) break;
+    result.crc32c = crc32c::Extend(
+        result.crc32c, reinterpret_cast<std::uint8_t*>(buffer.data()), n);
+    result.length += n;
+  }
+  return result;
+}
+
+}  // namespace
 
 std::string format_size(std::int64_t size) {
   struct range_definition {
@@ -37,6 +102,25 @@ std::string format_size(std::int64_t size) {
   return std::to_string(size / kPiB) + "PiB";
 }
 
+std::vector<std::int64_t> compute_slices(std::int64_t object_size,
+                                         std::int64_t minimum_slice_size,
+                                         int thread_count) {
+  std::vector<std::int64_t> result;
+  auto const thread_slice =
+      object_size / thread_count / kDirectIoAlignment * kDirectIoAlignment;
+  if (thread_slice > 0 && thread_slice >= minimum_slice_size) {
+    std::fill_n(std::back_inserter(result), thread_count, thread_slice);
+    // If the object size is not a multiple of the slice size we may need
+    // to add any excess bytes to the last slice.
+    result.back() += object_size - thread_slice * thread_count;
+    return result;
+  }
+  for (; object_size > 0; object_size -= minimum_slice_size) {
+    result.push_back(std::min(minimum_slice_size, object_size));
+  }
+  return result;
+}
+
 std::pair<std::int64_t, std::string> file_info(std::string const& filename) {
   std::ifstream is(filename, std::ios::binary);
   std::vector<char> buffer(1024 * 1024L);
@@ -50,11 +134,141 @@ std::pair<std::int64_t, std::string> file_info(std::string const& filename) {
     size += is.gcount();
   } while (not is.eof());
 
+  return {size, format_crc32c(crc32c)};
+}
+
+std::pair<std::int64_t, std::string> parallel_file_info(
+    std::string const& filename, int thread_count) {
+  auto const fd = static_cast<int>(
+      check_system_call("open", ::open(filename.c_str(), O_RDONLY)));
+  struct stat st {};
+  if (::fstat(fd, &st) != 0) {
+    auto err = errno;
+    ::close(fd);
+    errno = err;
+    check_system_call("fstat", -1);
+  }
+  auto const file_size = static_cast<std::int64_t>(st.st_size);
+
+  // Each thread checksums one chunk. Avoid chunks so small that combining the
+  // checksums dominates the cost.
+  auto constexpr kMinimumChunkSize = 16 * kMiB;
+  auto const chunk_size = (std::max)(
+      kMinimumChunkSize,
+      (file_size / (std::max)(thread_count, 1) + kMiB - 1) / kMiB * kMiB);
+
+  std::vector<std::future<range_checksum>> tasks;
+  for (std::int64_t offset = 0; offset < file_size; offset += chunk_size) {
+    tasks.push_back(std::async(std::launch::async, checksum_range, fd, offset,
+                               (std::min)(chunk_size, file_size - offset)));
+  }
+  std::vector<range_checksum> checksums;
+  std::exception_ptr error;
+  for (auto& t : tasks) {
+    try {
+      checksums.push_back(t.get());
+    } catch (...) {
+      error = std::current_exception();
+    }
+  }
+  ::close(fd);
+  if (error) std::rethrow_exception(error);
+  return combine_checksums(std::move(checksums));
+}
+
+std::vector<range_checksum> verify_ranges(std::string const& filename,
+                                          std::vector<range_checksum> ranges,
+                                          int thread_count) {
+  auto const fd = static_cast<int>(
+      check_system_call("open", ::open(filename.c_str(), O_RDONLY)));
+  std::atomic<std::size_t> next{0};
+  std::vector<char> valid(ranges.size(), 0);
+  auto verify = [&] {
+    for (auto i = next++; i < ranges.size(); i = next++) {
+      auto const& r = ranges[i];
+      auto const c = checksum_range(fd, r.offset, r.length);
+      valid[i] = c.length == r.length && c.crc32c == r.crc32c;
+    }
+  };
+  auto const task_count = (std::min)(
+      ranges.size(), static_cast<std::size_t>((std::max)(thread_count, 1)));
+  std::vector<std::future<void>> tasks;
+  for (std::size_t i = 0; i != task_count; ++i) {
+    tasks.push_back(std::async(std::launch::async, verify));
+  }
+  std::exception_ptr error;
+  for (auto& t : tasks) {
+    try {
+      t.get();
+    } catch (...) {
+      error = std::current_exception();
+    }
+  }
+  ::close(fd);
+  if (error) std::rethrow_exception(error);
+  std::vector<range_checksum> result;
+  for (std::size_t i = 0; i != ranges.size(); ++i) {
+    if (valid[i]) result.push_back(ranges[i]);
+  }
+  return result;
+}
+
+std::string format_crc32c(std::uint32_t crc32c) {
   static_assert(std::numeric_limits<unsigned char>::digits == 8,
                 "This program assumes an 8-bit char");
   boost::endian::big_uint32_buf_at buf(crc32c);
-  return {size, cppcodec::base64_rfc4648::encode(
-                    std::string(buf.data(), buf.data() + sizeof(buf)))};
+  return cppcodec::base64_rfc4648::encode(
+      std::string(buf.data(), buf.data() + sizeof(buf)));
+}
+
+// This is the "shift and xor" algorithm from zlib's crc32_combine(): appending
+// `len2` zero bytes to the first block is a linear operation over GF(2), and
+// the operator for `len2` bytes is built by repeated squaring.
+std::uint32_t crc32c_combine(std::uint32_t crc1, std::uint32_t crc2,
+                             std::int64_t len2) {
+  if (len2 <= 0) return crc1;
+
+  // The operator for a single zero bit.
+  gf2_matrix odd;
+  odd[0] = kCrc32cPolynomial;
+  std::uint32_t row = 1;
+  for (auto i = std::next(odd.begin()); i != odd.end(); ++i) {
+    *i = row;
+    row <<= 1;
+  }
+  // The operators for two and four zero bits.
+  auto even = gf2_matrix_square(odd);
+  odd = gf2_matrix_square(even);
+
+  // Apply `len2` zero bytes to crc1, the first squaring below produces the
+  // operator for one zero byte.
+  do {
+    even = gf2_matrix_square(odd);
+    if (len2 & 1) crc1 = gf2_matrix_times(even, crc1);
+    len2 >>= 1;
+    if (len2 == 0) break;
+    odd = gf2_matrix_square(even);
+    if (len2 & 1) crc1 = gf2_matrix_times(odd, crc1);
+    len2 >>= 1;
+  } while (len2 != 0);
+
+  return crc1 ^ crc2;
+}
+
+std::pair<std::int64_t, std::string> combine_checksums(
+    std::vector<range_checksum> ranges) {
+  std::sort(ranges.begin(), ranges.end(),
+            [](auto const& a, auto const& b) { return a.offset < b.offset; });
+  std::uint32_t crc32c = 0;
+  std::int64_t size = 0;
+  for (auto const& r : ranges) {
+    if (r.length == 0) continue;
+    // Stop at the first gap (or overlap), the caller detects the size mismatch.
+    if (r.offset != size) break;
+    crc32c = crc32c_combine(crc32c, r.crc32c, r.length);
+    size += r.length;
+  }
+  return {size, format_crc32c(crc32c)};
 }
 
 }  // namespace gcs_fast_transfers
@@ -18,15 +18,57 @@
 #include <cstdint>
 #include <string>
 #include <utility>
+#include <vector>
 
 namespace gcs_fast_transfers {
 
 // Format a size in human readable terms
 std::string format_size(std::int64_t size);
 
+// Split an object into one slice per thread, unless that would make the
+// slices smaller than `minimum_slice_size`. The slice boundaries are aligned
+// so the I/O engines can use direct I/O.
+std::vector<std::int64_t> compute_slices(std::int64_t object_size,
+                                         std::int64_t minimum_slice_size,
+                                         int thread_count);
+
 // Get the size and crc32c checksum of a file
 std::pair<std::int64_t, std::string> file_info(std::string const& filename);
 
+// Get the size and crc32c checksum of a file, like file_info(), but read and
+// checksum the file in chunks using up to `thread_count` threads, and join the
+// chunk checksums with crc32c_combine().
+std::pair<std::int64_t, std::string> parallel_file_info(
+    std::string const& filename, int thread_count);
+
+// Format a crc32c checksum using the same encoding as GCS metadata
+std::string format_crc32c(std::uint32_t crc32c);
+
+// Compute the crc32c checksum of two concatenated blocks, given the checksum
+// of each block and the length of the second block.
+std::uint32_t crc32c_combine(std::uint32_t crc1, std::uint32_t crc2,
+                             std::int64_t len2);
+
+// The crc32c checksum of `length` bytes starting at `offset`.
+struct range_checksum {
+  std::int64_t offset;
+  std::int64_t length;
+  std::uint32_t crc32c;
+};
+
+// Get the size and crc32c checksum of the data covered by `ranges`, in the
+// same format as file_info(). The ranges may be in any order, the size only
+// includes the bytes contiguously covered starting at offset 0.
+std::pair<std::int64_t, std::string> combine_checksums(
+    std::vector<range_checksum> ranges);
+
+// Read the data covered by `ranges` from `filename`, using up to
+// `thread_count` threads, and return the ranges whose data still matches
+// their checksum.
+std::vector<range_checksum> verify_ranges(std::string const& filename,
+                                          std::vector<range_checksum> ranges,
+                                          int thread_count);
+
 inline auto constexpr kKiB = std::int64_t(1024);
 inline auto constexpr kMiB = 1024 * kKiB;
 inline auto constexpr kGiB = 1024 * kMiB;
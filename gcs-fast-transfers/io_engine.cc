@@ -0,0 +1,371 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "io_engine.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+// Posix headers last.
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef GCS_FAST_TRANSFERS_HAVE_LIBURING
+#include <liburing.h>
+#endif  // GCS_FAST_TRANSFERS_HAVE_LIBURING
+
+namespace gcs_fast_transfers {
+namespace {
+
+std::int64_t check_system_call(std::string const& name, std::int64_t result) {
+  if (result >= 0) return result;
+  auto err = errno;
+  throw std::runtime_error("Error in " + name + "() - return value=" +
+                           std::to_string(result) + ", error=[" +
+                           std::to_string(err) + "] " + strerror(err));
+}
+
+bool is_aligned(std::int64_t value) {
+  return value % kDirectIoAlignment == 0;
+}
+
+int open_direct(std::string const& filename) {
+  return static_cast<int>(check_system_call(
+      "open(O_DIRECT)", ::open(filename.c_str(), O_WRONLY | O_DIRECT)));
+}
+
+class buffer_pool {
+ public:
+  buffer_pool(std::size_t buffer_size, int count) : buffer_size_(buffer_size) {
+    for (int i = 0; i != count; ++i) {
+      auto* p = static_cast<char*>(
+          std::aligned_alloc(kDirectIoAlignment, buffer_size));
+      if (p == nullptr) throw std::bad_alloc();
+      buffers_.emplace_back(p);
+      free_.push_back(p);
+    }
+  }
+
+  std::size_t buffer_size() const { return buffer_size_; }
+
+  // Return nullptr if all the buffers are in use.
+  char* pop() {
+    if (free_.empty()) return nullptr;
+    auto* b = free_.back();
+    free_.pop_back();
+    return b;
+  }
+
+  void push(char* buffer) { free_.push_back(buffer); }
+
+ private:
+  struct free_deleter {
+    void operator()(char* p) const { std::free(p); }
+  };
+
+  std::size_t buffer_size_;
+  std::vector<std::unique_ptr<char, free_deleter>> buffers_;
+  std::vector<char*> free_;
+};
+
+/**
+ * Starts the write-back of contiguous blocks of the file as they are written.
+ *
+ * Once a block of `interval` bytes is complete its write-back starts, without
+ * waiting. The previous block is likely written by then, the throttle waits
+ * for it, and drops it from the page cache.
+ */
+class writeback_throttle {
+ public:
+  writeback_throttle(int fd, std::int64_t interval)
+      : fd_(fd), interval_(interval) {}
+
+  void written(std::int64_t offset, std::int64_t length) {
+    if (interval_ == 0) return;
+    if (offset != end_) {
+      // Each thread writes mostly contiguous ranges, start a new block when
+      // it moves to a different range.
+      previous_ = block{0, 0};
+      start_ = offset;
+    }
+    end_ = offset + length;
+    if (end_ - start_ < interval_) return;
+    check_system_call("sync_file_range",
+                      ::sync_file_range(fd_, start_, end_ - start_,
+                                        SYNC_FILE_RANGE_WRITE));
+    if (previous_.length != 0) {
+      check_system_call(
+          "sync_file_range",
+          ::sync_file_range(fd_, previous_.offset, previous_.length,
+                            SYNC_FILE_RANGE_WAIT_BEFORE |
+                                SYNC_FILE_RANGE_WRITE |
+                                SYNC_FILE_RANGE_WAIT_AFTER));
+      // posix_fadvise() returns the error number, instead of setting errno.
+      auto const r = ::posix_fadvise(fd_, previous_.offset, previous_.length,
+                                     POSIX_FADV_DONTNEED);
+      if (r != 0) errno = r;
+      check_system_call("posix_fadvise", r == 0 ? 0 : -1);
+    }
+    previous_ = block{start_, end_ - start_};
+    start_ = end_;
+  }
+
+ private:
+  struct block {
+    std::int64_t offset;
+    std::int64_t length;
+  };
+
+  int fd_;
+  std::int64_t interval_;
+  std::int64_t start_ = 0;
+  std::int64_t end_ = 0;
+  block previous_{0, 0};
+};
+
+class pwrite_engine : public io_engine {
+ public:
+  pwrite_engine(int fd, std::size_t buffer_size, std::int64_t sync_interval)
+      : fd_(fd), pool_(buffer_size, 1), throttle_(fd, sync_interval) {}
+
+  std::size_t buffer_size() const override { return pool_.buffer_size(); }
+  char* allocate() override { return pool_.pop(); }
+  void release(char* buffer) override { pool_.push(buffer); }
+  void write(char* buffer, std::size_t length, std::int64_t offset) override {
+    pwrite_all(fd_, buffer, length, offset);
+    pool_.push(buffer);
+    throttle_.written(offset, static_cast<std::int64_t>(length));
+  }
+  void flush() override {}
+
+ private:
+  int fd_;
+  buffer_pool pool_;
+  writeback_throttle throttle_;
+};
+
+class odirect_engine : public io_engine {
+ public:
+  odirect_engine(std::string const& filename, int fd, std::size_t buffer_size)
+      : fd_(fd), direct_fd_(open_direct(filename)), pool_(buffer_size, 1) {}
+  ~odirect_engine() override { ::close(direct_fd_); }
+
+  std::size_t buffer_size() const override { return pool_.buffer_size(); }
+  char* allocate() override { return pool_.pop(); }
+  void release(char* buffer) override { pool_.push(buffer); }
+  void write(char* buffer, std::size_t length, std::int64_t offset) override {
+    // Write the aligned prefix directly, and any remaining bytes through the
+    // page cache.
+    auto const direct = is_aligned(offset) ? length / kDirectIoAlignment *
+                                                 kDirectIoAlignment
+                                           : 0;
+    pwrite_all(direct_fd_, buffer, direct, offset);
+    pwrite_all(fd_, buffer + direct, length - direct, offset + direct);
+    pool_.push(buffer);
+  }
+  void flush() override {}
+
+ private:
+  int fd_;
+  int direct_fd_;
+  buffer_pool pool_;
+};
+
+#ifdef GCS_FAST_TRANSFERS_HAVE_LIBURING
+class uring_engine : public io_engine {
+ public:
+  uring_engine(std::string const& filename, int fd, std::size_t buffer_size,
+               int queue_depth)
+      : fd_(fd),
+        direct_fd_(open_direct(filename)),
+        pool_(buffer_size, queue_depth),
+        batch_size_((std::max)(1, queue_depth / 2)) {
+    // io_uring_queue_init() returns -errno on failure.
+    auto const r = io_uring_queue_init(queue_depth, &ring_, 0);
+    if (r < 0) errno = -r;
+    check_system_call("io_uring_queue_init", r);
+  }
+
+  ~uring_engine() override {
+    // The kernel may still be reading from the buffers, wait for any writes
+    // in flight before releasing them.
+    try {
+      flush();
+    } catch (...) {
+    }
+    io_uring_queue_exit(&ring_);
+    ::close(direct_fd_);
+  }
+
+  std::size_t buffer_size() const override { return pool_.buffer_size(); }
+
+  char* allocate() override {
+    for (auto* b = pool_.pop(); b != nullptr || in_flight_ != 0;
+         b = pool_.pop()) {
+      if (b != nullptr) return b;
+      submit();
+      reap(/*wait=*/true);
+    }
+    throw std::logic_error("uring_engine buffer pool is exhausted");
+  }
+
+  void release(char* buffer) override { pool_.push(buffer); }
+
+  void write(char* buffer, std::size_t length, std::int64_t offset) override {
+    auto const direct = is_aligned(offset) ? length / kDirectIoAlignment *
+                                                 kDirectIoAlignment
+                                           : 0;
+    // Unaligned tails are rare (typically the end of the file), write them
+    // synchronously through the page cache.
+    pwrite_all(fd_, buffer + direct, length - direct, offset + direct);
+    if (direct == 0) return pool_.push(buffer);
+
+    auto* sqe = io_uring_get_sqe(&ring_);
+    if (sqe == nullptr) {
+      submit();
+      sqe = io_uring_get_sqe(&ring_);
+    }
+    if (sqe == nullptr) throw std::runtime_error("io_uring submission full");
+    io_uring_prep_write(sqe, direct_fd_, buffer, static_cast<unsigned>(direct),
+                        offset);
+    io_uring_sqe_set_data(sqe, buffer);
+    pending_[buffer] = pending_write{direct, offset};
+    ++in_flight_;
+    if (++unsubmitted_ >= batch_size_) submit();
+  }
+
+  void flush() override {
+    submit();
+    while (in_flight_ != 0) reap(/*wait=*/true);
+  }
+
+ private:
+  struct pending_write {
+    std::size_t length;
+    std::int64_t offset;
+  };
+
+  void submit() {
+    if (unsubmitted_ == 0) return;
+    auto const r = io_uring_submit(&ring_);
+    if (r < 0) errno = -r;
+    check_system_call("io_uring_submit", r);
+    unsubmitted_ = 0;
+  }
+
+  void reap(bool wait) {
+    io_uring_cqe* cqe = nullptr;
+    if (wait) {
+      auto const r = io_uring_wait_cqe(&ring_, &cqe);
+      if (r < 0) errno = -r;
+      check_system_call("io_uring_wait_cqe", r);
+    }
+    while (io_uring_peek_cqe(&ring_, &cqe) == 0) {
+      auto* buffer = static_cast<char*>(io_uring_cqe_get_data(cqe));
+      auto const result = cqe->res;
+      io_uring_cqe_seen(&ring_, cqe);
+      --in_flight_;
+      auto p = pending_.extract(buffer).mapped();
+      if (result < 0) errno = -result;
+      auto const n = static_cast<std::size_t>(
+          check_system_call("io_uring write", result));
+      // Complete any short writes synchronously.
+      pwrite_all(fd_, buffer + n, p.length - n, p.offset + n);
+      pool_.push(buffer);
+    }
+  }
+
+  int fd_;
+  int direct_fd_;
+  buffer_pool pool_;
+  int batch_size_;
+  io_uring ring_;
+  int unsubmitted_ = 0;
+  int in_flight_ = 0;
+  std::unordered_map<char*, pending_write> pending_;
+};
+#endif  // GCS_FAST_TRANSFERS_HAVE_LIBURING
+
+}  // namespace
+
+void pwrite_all(int fd, char const* buffer, std::size_t length,
+                std::int64_t offset) {
+  while (length != 0) {
+    auto const n =
+        check_system_call("pwrite", ::pwrite(fd, buffer, length, offset));
+    buffer += n;
+    length -= n;
+    offset += n;
+  }
+}
+
+bool io_engine_supported(std::string const& name) {
+#ifndef GCS_FAST_TRANSFERS_HAVE_LIBURING
+  if (name == "uring") return false;
+#endif  // GCS_FAST_TRANSFERS_HAVE_LIBURING
+  return std::any_of(std::begin(kIoEngineNames), std::end(kIoEngineNames),
+                     [&](auto const* n) { return name == n; });
+}
+
+std::unique_ptr<io_engine> make_io_engine(std::string const& name,
+                                          std::string const& filename, int fd,
+                                          std::size_t buffer_size,
+                                          int queue_depth,
+                                          std::int64_t sync_interval) {
+  // Direct I/O requires the buffer size to be a multiple of the alignment.
+  auto const size = (buffer_size + kDirectIoAlignment - 1) /
+                    kDirectIoAlignment * kDirectIoAlignment;
+  if (name == "pwrite") {
+    return std::make_unique<pwrite_engine>(fd, size, sync_interval);
+  }
+  if (name == "odirect") {
+    return std::make_unique<odirect_engine>(filename, fd, size);
+  }
+  if (name == "uring") {
+#ifdef GCS_FAST_TRANSFERS_HAVE_LIBURING
+    return std::make_unique<uring_engine>(filename, fd, size, queue_depth);
+#else
+    (void)queue_depth;
+    throw std::invalid_argument(
+        "this program was compiled without io_uring support");
+#endif  // GCS_FAST_TRANSFERS_HAVE_LIBURING
+  }
+  throw std::invalid_argument("unknown I/O engine: " + name);
+}
+
+bool preallocate_supported(std::string const& name) {
+  return std::any_of(std::begin(kPreallocateNames),
+                     std::end(kPreallocateNames),
+                     [&](auto const* n) { return name == n; });
+}
+
+std::string preallocate(int fd, std::int64_t size, std::string const& name) {
+  if (name == "none") return name;
+  if (name == "fallocate") {
+    // `fallocate()` rejects empty ranges with EINVAL.
+    if (size == 0 || ::fallocate(fd, 0, 0, size) == 0) return name;
+    if (errno != EOPNOTSUPP) check_system_call("fallocate", -1);
+  } else if (name != "sparse") {
+    throw std::invalid_argument("unknown preallocation method: " + name);
+  }
+  check_system_call("ftruncate", ::ftruncate(fd, size));
+  return "sparse";
+}
+
+}  // namespace gcs_fast_transfers
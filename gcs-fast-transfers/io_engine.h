@@ -0,0 +1,109 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GCS_FAST_TRANSFERS_IO_ENGINE_H
+#define GCS_FAST_TRANSFERS_IO_ENGINE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace gcs_fast_transfers {
+
+// Direct I/O requires buffers, offsets, and lengths aligned to the logical
+// block size of the device. 4KiB works for all common devices.
+inline auto constexpr kDirectIoAlignment = std::int64_t(4096);
+
+/**
+ * Writes blocks of data at arbitrary offsets of a destination file.
+ *
+ * Each engine owns a pool of buffers, aligned to `kDirectIoAlignment`. The
+ * caller obtains a buffer with `allocate()`, fills it, and passes it back with
+ * `write()`. Asynchronous engines return the buffer to the pool once the write
+ * completes. Engines are not thread-safe, use one engine per thread.
+ */
+class io_engine {
+ public:
+  virtual ~io_engine() = default;
+
+  // The size of each buffer returned by `allocate()`.
+  virtual std::size_t buffer_size() const = 0;
+
+  // Get a buffer from the pool, waiting for pending writes if needed.
+  virtual char* allocate() = 0;
+
+  // Return a buffer to the pool without writing it.
+  virtual void release(char* buffer) = 0;
+
+  // Write `length` bytes from `buffer` at `offset`, the engine owns the buffer
+  // until the write completes.
+  virtual void write(char* buffer, std::size_t length, std::int64_t offset) = 0;
+
+  // Wait for all pending writes, throws on errors.
+  virtual void flush() = 0;
+};
+
+// Write @p length bytes at @p offset, continuing after short writes. Throws
+// on errors.
+void pwrite_all(int fd, char const* buffer, std::size_t length,
+                std::int64_t offset);
+
+// The names accepted by `make_io_engine()`.
+inline char const* const kIoEngineNames[] = {"pwrite", "odirect", "uring"};
+
+// Return true if @p name is a known engine, and it is supported by this build.
+bool io_engine_supported(std::string const& name);
+
+/**
+ * Create an engine writing to @p filename.
+ *
+ * The `pwrite` engine issues blocking `pwrite()` calls on @p fd. The `odirect`
+ * engine opens @p filename with `O_DIRECT` and bypasses the page cache. The
+ * `uring` engine also uses `O_DIRECT`, but submits writes through `io_uring`
+ * in batches, keeping up to @p queue_depth writes in flight. Both fall back to
+ * @p fd for writes that are not suitably aligned, such as the last block of
+ * the file.
+ *
+ * If @p sync_interval is not zero, the `pwrite` engine starts the write-back
+ * of each @p sync_interval contiguous bytes as soon as they are written, and
+ * waits for the previous block before dropping it from the page cache. This
+ * spreads the write-back over the whole download, instead of stalling all the
+ * threads once the kernel reaches its dirty page limits.
+ */
+std::unique_ptr<io_engine> make_io_engine(std::string const& name,
+                                          std::string const& filename, int fd,
+                                          std::size_t buffer_size,
+                                          int queue_depth,
+                                          std::int64_t sync_interval);
+
+// The names accepted by `preallocate()`.
+inline char const* const kPreallocateNames[] = {"none", "sparse", "fallocate"};
+
+// Return true if @p name is a known preallocation method.
+bool preallocate_supported(std::string const& name);
+
+/**
+ * Set the size of the file @p fd to @p size before writing to it.
+ *
+ * With `sparse` the file is extended with `ftruncate()`, so the concurrent
+ * writes do not extend the file out of order. With `fallocate` the blocks are
+ * also allocated, which reduces fragmentation, this falls back to `sparse` on
+ * filesystems that do not support `fallocate()`. Returns the method used.
+ */
+std::string preallocate(int fd, std::int64_t size, std::string const& name);
+
+}  // namespace gcs_fast_transfers
+
+#endif  // GCS_FAST_TRANSFERS_IO_ENGINE_H
@@ -0,0 +1,472 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gcs_fast_transfers.h"
+#include <boost/program_options.hpp>
+#include <fmt/format.h>
+#include <google/cloud/storage/client.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+// Posix headers last.
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace {
+namespace po = boost::program_options;
+namespace gcs = google::cloud::storage;
+po::variables_map parse_command_line(int argc, char* argv[]);
+int check_system_call(std::string const& name, int result);
+
+using ::gcs_fast_transfers::format_size;
+using ::gcs_fast_transfers::kMiB;
+
+auto constexpr kEmulatorEndpointVariable = "CLOUD_STORAGE_EMULATOR_ENDPOINT";
+// The proxy assumes a new request starts when a connection receives data
+// after being idle for this long.
+auto constexpr kIdleTimeout = std::chrono::milliseconds(10);
+
+struct fault_options {
+  // Delay the first chunk of each request, this adds to the time-to-first-byte
+  // of every request.
+  std::chrono::milliseconds latency;
+  // Maximum bytes per second in each direction of each connection, 0 means
+  // unlimited.
+  std::int64_t bandwidth_limit;
+  // Probability of resetting a connection for each MiB transferred.
+  double failure_rate;
+};
+
+/**
+ * A TCP proxy in front of the storage testbench that injects faults.
+ *
+ * The testbench serves requests as fast as the local host allows. The proxy
+ * adds latency, caps the bandwidth of each connection, and resets
+ * connections at random, to approximate a real network in a repeatable way.
+ * Each connection uses two threads, one per direction.
+ */
+class fault_proxy {
+ public:
+  fault_proxy(std::string upstream_host, std::string upstream_port,
+              fault_options options)
+      : upstream_host_(std::move(upstream_host)),
+        upstream_port_(std::move(upstream_port)),
+        options_(options) {
+    listen_fd_ =
+        check_system_call("socket()", ::socket(AF_INET, SOCK_STREAM, 0));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    check_system_call("bind()",
+                      ::bind(listen_fd_, reinterpret_cast<sockaddr*>(&address),
+                             sizeof(address)));
+    check_system_call("listen()", ::listen(listen_fd_, SOMAXCONN));
+    socklen_t length = sizeof(address);
+    check_system_call(
+        "getsockname()",
+        ::getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&address),
+                      &length));
+    port_ = ntohs(address.sin_port);
+    accept_thread_ = std::thread([this] { accept_loop(); });
+  }
+
+  ~fault_proxy() {
+    // Wake up the accept() call, the connection threads are detached and do
+    // not use this object.
+    stop_ = true;
+    ::shutdown(listen_fd_, SHUT_RDWR);
+    accept_thread_.join();
+    ::close(listen_fd_);
+  }
+
+  int port() const { return port_; }
+
+ private:
+  void accept_loop() {
+    while (not stop_) {
+      auto const client = ::accept(listen_fd_, nullptr, nullptr);
+      if (client < 0) continue;
+      auto const upstream = connect_upstream();
+      if (upstream < 0) {
+        ::close(client);
+        continue;
+      }
+      auto connection = std::make_shared<std::atomic<int>>(2);
+      auto seed = static_cast<unsigned>(generator_());
+      // Only delay the requests, the responses are limited by bandwidth.
+      auto request = options_;
+      auto response = options_;
+      response.latency = std::chrono::milliseconds(0);
+      std::thread(relay, client, upstream, request, seed, connection).detach();
+      std::thread(relay, upstream, client, response, seed + 1, connection)
+          .detach();
+    }
+  }
+
+  int connect_upstream() const {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (::getaddrinfo(upstream_host_.c_str(), upstream_port_.c_str(), &hints,
+                      &addresses) != 0) {
+      return -1;
+    }
+    int fd = -1;
+    for (auto* a = addresses; a != nullptr; a = a->ai_next) {
+      fd = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (fd < 0) continue;
+      if (::connect(fd, a->ai_addr, a->ai_addrlen) == 0) break;
+      ::close(fd);
+      fd = -1;
+    }
+    ::freeaddrinfo(addresses);
+    return fd;
+  }
+
+  // Copy data from `from` to `to` until either side closes the connection.
+  static void relay(int from, int to, fault_options options, unsigned seed,
+                    std::shared_ptr<std::atomic<int>> const& connection) {
+    std::mt19937_64 generator(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::vector<char> buffer(64 * 1024);
+    auto const start = std::chrono::steady_clock::now();
+    std::int64_t total = 0;
+    // Delay only the first chunk of each request, delaying every chunk would
+    // limit the throughput of large uploads.
+    bool idle = true;
+    for (;;) {
+      if (not idle) {
+        pollfd p{from, POLLIN, 0};
+        idle = ::poll(&p, 1, static_cast<int>(kIdleTimeout.count())) == 0;
+      }
+      auto const n = ::recv(from, buffer.data(), buffer.size(), 0);
+      if (n <= 0) break;
+      if (idle && options.latency.count() != 0) {
+        std::this_thread::sleep_for(options.latency);
+      }
+      idle = false;
+      auto const p = options.failure_rate * static_cast<double>(n) / kMiB;
+      if (uniform(generator) < p) break;
+      if (not send_all(to, buffer.data(), n)) break;
+      total += n;
+      if (options.bandwidth_limit != 0) {
+        // Sleep until the average rate is back under the limit.
+        auto const expected = std::chrono::microseconds(
+            total * 1'000'000 / options.bandwidth_limit);
+        std::this_thread::sleep_until(start + expected);
+      }
+    }
+    // Stop both directions, the last thread to exit closes the sockets.
+    ::shutdown(from, SHUT_RDWR);
+    ::shutdown(to, SHUT_RDWR);
+    if (--*connection == 0) {
+      ::close(from);
+      ::close(to);
+    }
+  }
+
+  static bool send_all(int fd, char const* data, std::size_t size) {
+    while (size != 0) {
+      auto const n = ::send(fd, data, size, MSG_NOSIGNAL);
+      if (n <= 0) return false;
+      data += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  std::string upstream_host_;
+  std::string upstream_port_;
+  fault_options options_;
+  int listen_fd_ = -1;
+  int port_ = 0;
+  std::mt19937_64 generator_{std::random_device{}()};
+  std::atomic<bool> stop_{false};
+  std::thread accept_thread_;
+};
+
+/// Split an endpoint such as `http://localhost:9000` into host and port.
+std::pair<std::string, std::string> parse_endpoint(std::string endpoint) {
+  auto const scheme = endpoint.find("://");
+  if (scheme != std::string::npos) endpoint = endpoint.substr(scheme + 3);
+  endpoint = endpoint.substr(0, endpoint.find('/'));
+  auto const colon = endpoint.rfind(':');
+  if (colon == std::string::npos) return {endpoint, "80"};
+  return {endpoint.substr(0, colon), endpoint.substr(colon + 1)};
+}
+
+/// Run @p command using @p endpoint as the storage service, and time it.
+std::pair<int, std::chrono::milliseconds> run(std::string const& command,
+                                              std::string const& endpoint) {
+  ::setenv(kEmulatorEndpointVariable, endpoint.c_str(), 1);
+  auto const start = std::chrono::steady_clock::now();
+  auto const status = std::system((command + " >/dev/null 2>&1").c_str());
+  auto const elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  return {WIFEXITED(status) ? WEXITSTATUS(status) : -1, elapsed};
+}
+
+void create_source_file(std::string const& filename, std::int64_t size) {
+  std::vector<char> block(kMiB);
+  std::generate(block.begin(), block.end(),
+                [g = std::mt19937_64(std::random_device{}())]() mutable {
+                  return static_cast<char>(g());
+                });
+  std::ofstream os(filename, std::ios::binary | std::ios::trunc);
+  for (std::int64_t offset = 0; offset < size; offset += kMiB) {
+    os.write(block.data(), (std::min)(kMiB, size - offset));
+  }
+  os.close();
+  if (not os) throw std::runtime_error("cannot create " + filename);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) try {
+  auto vm = parse_command_line(argc, argv);
+  auto const endpoint = vm["emulator-endpoint"].as<std::string>();
+  auto const bucket = vm["bucket"].as<std::string>();
+  auto const object_size = vm["object-size"].as<std::int64_t>();
+  auto const scratch =
+      std::filesystem::path(vm["scratch-dir"].as<std::string>());
+  auto const source = (scratch / "transfer-benchmark-source.bin").string();
+  auto const destination =
+      (scratch / "transfer-benchmark-destination.bin").string();
+  auto const object = "transfer-benchmark-" + std::to_string(object_size);
+  auto const bin = std::filesystem::path(argv[0]).parent_path();
+  auto program = [&](std::string const& name) {
+    if (vm.count(name + "-program") != 0) {
+      return vm[name + "-program"].as<std::string>();
+    }
+    return (bin / name).string();
+  };
+
+  auto const latency = vm["latency-ms"].as<int>();
+  auto const bandwidth_limit = vm["bandwidth-limit"].as<std::int64_t>();
+  auto const failure_rate = vm["failure-rate"].as<double>();
+  auto [host, port] = parse_endpoint(endpoint);
+  fault_proxy proxy(host, port,
+                    fault_options{std::chrono::milliseconds(latency),
+                                  bandwidth_limit, failure_rate});
+  auto const proxy_endpoint = fmt::format("http://127.0.0.1:{}", proxy.port());
+
+  // Create the bucket and the source object directly in the testbench,
+  // without any injected faults.
+  std::cout << "# Creating a " << format_size(object_size) << " object in "
+            << endpoint << std::endl;
+  ::setenv(kEmulatorEndpointVariable, endpoint.c_str(), 1);
+  auto client = gcs::Client();
+  auto bucket_metadata = client.CreateBucket(bucket, gcs::BucketMetadata());
+  if (not bucket_metadata &&
+      bucket_metadata.status().code() !=
+          google::cloud::StatusCode::kAlreadyExists) {
+    throw std::runtime_error(bucket_metadata.status().message());
+  }
+  create_source_file(source, object_size);
+  auto const [setup_status, setup_elapsed] = run(
+      fmt::format("{} {} {} {}", program("upload"), source, bucket, object),
+      endpoint);
+  if (setup_status != 0) {
+    throw std::runtime_error("cannot upload the benchmark object");
+  }
+
+  std::ostream* os = &std::cout;
+  std::ofstream results;
+  if (vm.count("results") != 0) {
+    results.open(vm["results"].as<std::string>());
+    os = &results;
+  }
+  *os << "Tool,ThreadCount,SliceSize,ObjectSize,LatencyMs,BandwidthLimit,"
+      << "FailureRate,Iteration,ElapsedMs,MiBs,ExitStatus" << std::endl;
+  auto report = [&](char const* tool, int threads, std::int64_t slice,
+                    int iteration,
+                    std::pair<int, std::chrono::milliseconds> r) {
+    auto const mibs = r.second.count() == 0
+                          ? 0.0
+                          : (static_cast<double>(object_size) / kMiB) /
+                                (static_cast<double>(r.second.count()) / 1000);
+    *os << fmt::format("{},{},{},{},{},{},{},{},{},{:.2f},{}", tool, threads,
+                       slice, object_size, latency, bandwidth_limit,
+                       failure_rate, iteration, r.second.count(), mibs,
+                       r.first)
+        << std::endl;
+  };
+
+  for (int i = 0; i != vm["iterations"].as<int>(); ++i) {
+    for (auto threads : vm["thread-count"].as<std::vector<int>>()) {
+      for (auto slice : vm["slice-size"].as<std::vector<std::int64_t>>()) {
+        report("download", threads, slice, i,
+               run(fmt::format("{} {} {} {} --thread-count={} "
+                               "--minimum-slice-size={} --progress-interval=0",
+                               program("download"), bucket, object,
+                               destination, threads, slice),
+                   proxy_endpoint));
+        report("upload", threads, slice, i,
+               run(fmt::format("{} {} {} {}-upload --max-streams={} "
+                               "--part-size={}",
+                               program("upload"), source, bucket, object,
+                               threads, slice),
+                   proxy_endpoint));
+      }
+    }
+  }
+
+  std::remove(source.c_str());
+  std::remove(destination.c_str());
+  return 0;
+} catch (std::exception const& ex) {
+  std::cerr << "Standard C++ exception thrown: " << ex.what() << std::endl;
+  return 1;
+} catch (...) {
+  std::cerr << "Unknown C++ exception thrown" << std::endl;
+  return 1;
+}
+
+namespace {
+
+[[noreturn]] void usage(std::string const& argv0,
+                        po::options_description const& desc,
+                        std::string const& message = {}) {
+  auto exit_status = EXIT_SUCCESS;
+  if (not message.empty()) {
+    exit_status = EXIT_FAILURE;
+    std::cout << "Error: " << message << "\n";
+  }
+
+  // print usage + options help, and exit normally
+  std::cout << "usage: " << argv0 << " [options]\n\n" << desc << "\n";
+  std::exit(exit_status);
+}
+
+po::variables_map parse_command_line(int argc, char* argv[]) {
+  auto const default_object_size = 1 * gcs_fast_transfers::kGiB;
+  std::vector<int> const default_thread_counts{1, 4, 16, 64};
+  std::vector<std::int64_t> const default_slice_sizes{8 * kMiB, 32 * kMiB,
+                                                      128 * kMiB};
+
+  po::options_description desc(
+      "Measure the download and upload programs against the storage "
+      "testbench, with injected latency, bandwidth limits, and failures");
+  desc.add_options()("help", "produce help message")
+      //
+      ("emulator-endpoint",
+       po::value<std::string>()->default_value("http://localhost:9000"),
+       "the storage testbench endpoint")
+      //
+      ("bucket",
+       po::value<std::string>()->default_value("fast-transfers-benchmark"),
+       "the bucket used in the testbench, it is created if needed")
+      //
+      ("object-size",
+       po::value<std::int64_t>()->default_value(default_object_size),
+       "the size of the object to download and upload")
+      //
+      ("thread-count",
+       po::value<std::vector<int>>()->multitoken()->default_value(
+           default_thread_counts, "1 4 16 64"),
+       "the thread counts (or upload streams) to sweep")
+      //
+      ("slice-size",
+       po::value<std::vector<std::int64_t>>()->multitoken()->default_value(
+           default_slice_sizes, "8MiB 32MiB 128MiB"),
+       "the minimum slice sizes (or upload part sizes) to sweep")
+      //
+      ("latency-ms", po::value<int>()->default_value(0),
+       "latency added to each request, in milliseconds")
+      //
+      ("bandwidth-limit", po::value<std::int64_t>()->default_value(0),
+       "maximum bytes per second for each connection, 0 means unlimited")
+      //
+      ("failure-rate", po::value<double>()->default_value(0),
+       "probability of resetting a connection for each MiB transferred")
+      //
+      ("iterations", po::value<int>()->default_value(1),
+       "number of times to run each configuration")
+      //
+      ("scratch-dir", po::value<std::string>()->default_value("."),
+       "directory for the source and destination files")
+      //
+      ("results", po::value<std::string>(),
+       "write the results to this CSV file, instead of stdout")
+      //
+      ("download-program", po::value<std::string>(),
+       "the download program, defaults to `download` in the same directory "
+       "as this program")
+      //
+      ("upload-program", po::value<std::string>(),
+       "the upload program, defaults to `upload` in the same directory as "
+       "this program");
+
+  po::variables_map vm;
+  try {
+    po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+    po::notify(vm);
+  } catch (std::exception const& ex) {
+    usage(argv[0], desc, ex.what());
+  }
+
+  if (vm.count("help") != 0) usage(argv[0], desc);
+
+  if (vm["object-size"].as<std::int64_t>() <= 0) {
+    usage(argv[0], desc, "the --object-size option must be positive");
+  }
+  for (auto t : vm["thread-count"].as<std::vector<int>>()) {
+    if (t > 0) continue;
+    usage(argv[0], desc, "the --thread-count values must be positive");
+  }
+  for (auto s : vm["slice-size"].as<std::vector<std::int64_t>>()) {
+    if (s > 0) continue;
+    usage(argv[0], desc, "the --slice-size values must be positive");
+  }
+  if (vm["latency-ms"].as<int>() < 0) {
+    usage(argv[0], desc, "the --latency-ms option cannot be negative");
+  }
+  if (vm["bandwidth-limit"].as<std::int64_t>() < 0) {
+    usage(argv[0], desc, "the --bandwidth-limit option cannot be negative");
+  }
+  if (vm["failure-rate"].as<double>() < 0) {
+    usage(argv[0], desc, "the --failure-rate option cannot be negative");
+  }
+
+  return vm;
+}
+
+int check_system_call(std::string const& name, int result) {
+  if (result >= 0) return result;
+  auto err = errno;
+  throw std::runtime_error(
+      fmt::format("Error in {}() - return value={}, error=[{}] {}", name,
+                  result, err, strerror(err)));
+}
+
+}  // namespace
@@ -0,0 +1,302 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "transfer_stats.h"
+#include "gcs_fast_transfers.h"
+#include <fmt/format.h>
+#include <fmt/ranges.h>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <numeric>
+
+namespace gcs_fast_transfers {
+namespace {
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+
+int latency_bucket(std::chrono::microseconds latency) {
+  auto us = static_cast<std::uint64_t>(
+      (std::max)(latency.count(), std::chrono::microseconds::rep{0}));
+  int bucket = 0;
+  for (; us != 0 && bucket + 1 < transfer_stats::kHistogramBuckets; us >>= 1) {
+    ++bucket;
+  }
+  return bucket;
+}
+
+double bandwidth_MiBs(std::int64_t bytes, transfer_stats::clock::duration d) {
+  auto const us = duration_cast<microseconds>(d).count();
+  if (us <= 0) return 0;
+  return (static_cast<double>(bytes) / kMiB) / (us / 1'000'000.0);
+}
+
+std::string json_string(std::string const& value) {
+  std::string result = "\"";
+  for (auto c : value) {
+    switch (c) {
+      case '"':
+        result += "\\\"";
+        break;
+      case '\\':
+        result += "\\\\";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          result += fmt::format("\\u{:04x}", static_cast<int>(c));
+        } else {
+          result += c;
+        }
+    }
+  }
+  return result + "\"";
+}
+
+std::string histogram_json(transfer_stats::histogram const& h) {
+  std::vector<std::string> buckets;
+  for (int i = 0; i != transfer_stats::kHistogramBuckets; ++i) {
+    if (h[i] == 0) continue;
+    buckets.push_back(fmt::format(R"({{"lt_us":{},"count":{}}})",
+                                  std::int64_t{1} << i, h[i]));
+  }
+  return fmt::format(
+      R"({{"p50_us":{},"p90_us":{},"p99_us":{},"buckets":[{}]}})",
+      histogram_quantile(h, 0.5), histogram_quantile(h, 0.9),
+      histogram_quantile(h, 0.99), fmt::join(buckets, ","));
+}
+
+}  // namespace
+
+transfer_stats::transfer_stats(int stream_count) : start_(clock::now()) {
+  std::generate_n(std::back_inserter(streams_), stream_count, [this] {
+    auto s = std::make_unique<stream>();
+    s->last_progress = start_.time_since_epoch().count();
+    return s;
+  });
+}
+
+void transfer_stats::record_read(int id, std::int64_t bytes,
+                                 std::chrono::microseconds latency) {
+  auto& s = *streams_[id];
+  s.bytes.fetch_add(bytes, std::memory_order_relaxed);
+  s.reads.fetch_add(1, std::memory_order_relaxed);
+  s.latency[latency_bucket(latency)].fetch_add(1, std::memory_order_relaxed);
+  if (bytes != 0) {
+    s.last_progress.store(clock::now().time_since_epoch().count(),
+                          std::memory_order_relaxed);
+  }
+}
+
+void transfer_stats::stream_done(int id) {
+  streams_[id]->done.store(true, std::memory_order_relaxed);
+}
+
+void transfer_stats::stream_waiting(int id, bool waiting) {
+  auto& s = *streams_[id];
+  // Restart the stall timer when the stream issues its next read.
+  if (not waiting) {
+    s.last_progress.store(clock::now().time_since_epoch().count(),
+                          std::memory_order_relaxed);
+  }
+  s.waiting.store(waiting, std::memory_order_relaxed);
+}
+
+void transfer_stats::record_stall(int id) {
+  streams_[id]->stalls.fetch_add(1, std::memory_order_relaxed);
+}
+
+transfer_stats::stream_snapshot transfer_stats::snapshot(int id) const {
+  auto const& s = *streams_[id];
+  stream_snapshot result{
+      s.bytes.load(std::memory_order_relaxed),
+      s.reads.load(std::memory_order_relaxed),
+      s.stalls.load(std::memory_order_relaxed),
+      s.done.load(std::memory_order_relaxed),
+      s.waiting.load(std::memory_order_relaxed),
+      clock::time_point(
+          clock::duration(s.last_progress.load(std::memory_order_relaxed))),
+      {}};
+  std::transform(
+      s.latency.begin(), s.latency.end(), result.latency.begin(),
+      [](auto const& c) { return c.load(std::memory_order_relaxed); });
+  return result;
+}
+
+std::int64_t transfer_stats::total_bytes() const {
+  return std::accumulate(streams_.begin(), streams_.end(), std::int64_t{0},
+                         [](auto a, auto const& s) {
+                           return a + s->bytes.load(std::memory_order_relaxed);
+                         });
+}
+
+void transfer_stats::add_sample(clock::time_point now, std::int64_t bytes) {
+  std::lock_guard<std::mutex> lk(mu_);
+  samples_.emplace_back(now - start_, bytes);
+}
+
+std::string transfer_stats::to_json(
+    std::vector<std::pair<std::string, std::string>> const& parameters,
+    clock::time_point end) const {
+  std::vector<std::string> params;
+  for (auto const& [key, value] : parameters) {
+    params.push_back(json_string(key) + ":" + json_string(value));
+  }
+
+  histogram total_latency{};
+  std::vector<std::string> streams;
+  for (int id = 0; id != stream_count(); ++id) {
+    auto const s = snapshot(id);
+    std::transform(total_latency.begin(), total_latency.end(),
+                   s.latency.begin(), total_latency.begin(), std::plus<>{});
+    streams.push_back(fmt::format(
+        R"({{"id":{},"bytes":{},"reads":{},"stalls":{},)"
+        R"("bandwidth_MiBs":{:.2f},"read_latency":{}}})",
+        id, s.bytes, s.reads, s.stalls,
+        bandwidth_MiBs(s.bytes, s.last_progress - start_),
+        histogram_json(s.latency)));
+  }
+
+  std::vector<std::string> samples;
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    for (auto const& [elapsed, bytes] : samples_) {
+      samples.push_back(fmt::format(
+          R"({{"elapsed_ms":{},"bytes":{}}})",
+          duration_cast<std::chrono::milliseconds>(elapsed).count(), bytes));
+    }
+  }
+
+  auto const bytes = total_bytes();
+  return fmt::format(
+      R"({{"parameters":{{{}}},"elapsed_us":{},"bytes":{},)"
+      R"("bandwidth_MiBs":{:.2f},"read_latency":{},"streams":[{}],)"
+      R"("samples":[{}]}})",
+      fmt::join(params, ","), duration_cast<microseconds>(end - start_).count(),
+      bytes, bandwidth_MiBs(bytes, end - start_), histogram_json(total_latency),
+      fmt::join(streams, ","), fmt::join(samples, ","));
+}
+
+std::int64_t histogram_quantile(transfer_stats::histogram const& h, double q) {
+  auto const count = std::accumulate(h.begin(), h.end(), std::int64_t{0});
+  if (count == 0) return 0;
+  auto const target = static_cast<std::int64_t>(q * static_cast<double>(count));
+  std::int64_t seen = 0;
+  for (int i = 0; i != transfer_stats::kHistogramBuckets; ++i) {
+    seen += h[i];
+    if (seen > target) return std::int64_t{1} << i;
+  }
+  return std::int64_t{1} << (transfer_stats::kHistogramBuckets - 1);
+}
+
+progress_reporter::progress_reporter(transfer_stats& stats, std::ostream& os,
+                                     std::chrono::milliseconds interval,
+                                     std::chrono::milliseconds stall_timeout)
+    : stats_(stats),
+      os_(os),
+      interval_(interval),
+      stall_timeout_(stall_timeout),
+      last_report_(stats.start()),
+      last_bytes_(stats.stream_count()),
+      stalled_(stats.stream_count()),
+      thread_([this] { run(); }) {}
+
+progress_reporter::~progress_reporter() {
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+void progress_reporter::run() {
+  std::unique_lock<std::mutex> lk(mu_);
+  while (not cv_.wait_for(lk, interval_, [this] { return stop_; })) {
+    report();
+  }
+}
+
+void progress_reporter::report() {
+  auto const now = transfer_stats::clock::now();
+  auto const elapsed = now - last_report_;
+  std::vector<double> stream_bandwidth;
+  std::vector<int> stalled;
+  std::int64_t total = 0;
+  for (int id = 0; id != stats_.stream_count(); ++id) {
+    auto const s = stats_.snapshot(id);
+    total += s.bytes;
+    stream_bandwidth.push_back(
+        bandwidth_MiBs(s.bytes - last_bytes_[id], elapsed));
+    last_bytes_[id] = s.bytes;
+    // Count each stall once, no matter how many reports it spans.
+    auto const is_stalled = not s.done && not s.waiting &&
+                            now - s.last_progress > stall_timeout_;
+    if (is_stalled) stalled.push_back(id);
+    if (is_stalled && not stalled_[id]) stats_.record_stall(id);
+    stalled_[id] = is_stalled;
+  }
+  stats_.add_sample(now, total);
+
+  os_ << fmt::format(
+      "Progress: {} in {}s, {:.2f} MiB/s, per-stream MiB/s [{:.1f}]\n",
+      format_size(total),
+      duration_cast<std::chrono::seconds>(now - stats_.start()).count(),
+      bandwidth_MiBs(total - last_total_, elapsed),
+      fmt::join(stream_bandwidth, ", "));
+  if (not stalled.empty()) {
+    os_ << fmt::format("Stalled streams, no data for over {}ms: [{}]\n",
+                       stall_timeout_.count(), fmt::join(stalled, ", "));
+  }
+  os_.flush();
+  last_total_ = total;
+  last_report_ = now;
+}
+
+std::unique_ptr<progress_reporter> make_progress_reporter(
+    transfer_stats& stats, std::ostream& os,
+    boost::program_options::variables_map const& vm) {
+  auto const interval = vm["progress-interval"].as<int>();
+  if (interval == 0) return nullptr;
+  return std::make_unique<progress_reporter>(
+      stats, os, std::chrono::seconds(interval),
+      std::chrono::seconds(vm["stall-timeout"].as<int>()));
+}
+
+void write_stats_json(transfer_stats const& stats,
+                      boost::program_options::variables_map const& vm,
+                      transfer_stats::clock::time_point end) {
+  if (vm.count("stats-json") == 0) return;
+  // Include all the options, so the results can be correlated with them.
+  std::vector<std::pair<std::string, std::string>> parameters;
+  for (auto const& [name, value] : vm) {
+    auto const& v = value.value();
+    if (auto const* s = boost::any_cast<std::string>(&v)) {
+      parameters.emplace_back(name, *s);
+    } else if (auto const* i = boost::any_cast<int>(&v)) {
+      parameters.emplace_back(name, std::to_string(*i));
+    } else if (auto const* l = boost::any_cast<std::int64_t>(&v)) {
+      parameters.emplace_back(name, std::to_string(*l));
+    } else if (auto const* b = boost::any_cast<bool>(&v)) {
+      parameters.emplace_back(name, *b ? "true" : "false");
+    } else if (auto const* d = boost::any_cast<double>(&v)) {
+      parameters.emplace_back(name, std::to_string(*d));
+    }
+  }
+  parameters.emplace_back("stream-count", std::to_string(stats.stream_count()));
+  std::ofstream(vm["stats-json"].as<std::string>())
+      << stats.to_json(parameters, end) << "\n";
+}
+
+}  // namespace gcs_fast_transfers
@@ -0,0 +1,178 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GCS_FAST_TRANSFERS_TRANSFER_STATS_H
+#define GCS_FAST_TRANSFERS_TRANSFER_STATS_H
+
+#include <boost/program_options/variables_map.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace gcs_fast_transfers {
+
+/**
+ * Collects the throughput and read latency of each stream in a transfer.
+ *
+ * Each stream only updates its own counters, with relaxed atomics, so
+ * recording a read is cheap and does not contend with other streams. The
+ * counters may be read at any time, for example by `progress_reporter`.
+ */
+class transfer_stats {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  // The read latency histogram uses power of 2 buckets, bucket `i` counts the
+  // reads that took less than 2^i microseconds.
+  static auto constexpr kHistogramBuckets = 32;
+  using histogram = std::array<std::int64_t, kHistogramBuckets>;
+
+  explicit transfer_stats(int stream_count);
+
+  int stream_count() const { return static_cast<int>(streams_.size()); }
+  clock::time_point start() const { return start_; }
+
+  // Record a read call in stream @p id that returned @p bytes.
+  void record_read(int id, std::int64_t bytes,
+                   std::chrono::microseconds latency);
+
+  // Mark stream @p id as finished, finished streams are not stalled.
+  void stream_done(int id);
+
+  // Mark stream @p id as waiting, or no longer waiting, for its next read.
+  // Waiting streams have no outstanding reads, so they are not stalled.
+  void stream_waiting(int id, bool waiting);
+
+  // Count a stall in stream @p id, as detected by `progress_reporter`.
+  void record_stall(int id);
+
+  struct stream_snapshot {
+    std::int64_t bytes;
+    std::int64_t reads;
+    std::int64_t stalls;
+    bool done;
+    bool waiting;
+    clock::time_point last_progress;
+    histogram latency;
+  };
+  stream_snapshot snapshot(int id) const;
+
+  // The total bytes transferred by all the streams.
+  std::int64_t total_bytes() const;
+
+  // Record a sample of the aggregate progress, included in the JSON output.
+  void add_sample(clock::time_point now, std::int64_t bytes);
+
+  /**
+   * Format the statistics as a JSON object.
+   *
+   * @p parameters describe the transfer, such as the object name and the
+   * command-line options, and are included as strings in the output.
+   */
+  std::string to_json(
+      std::vector<std::pair<std::string, std::string>> const& parameters,
+      clock::time_point end) const;
+
+ private:
+  struct stream {
+    std::atomic<std::int64_t> bytes{0};
+    std::atomic<std::int64_t> reads{0};
+    std::atomic<std::int64_t> stalls{0};
+    std::atomic<bool> done{false};
+    std::atomic<bool> waiting{false};
+    std::atomic<clock::rep> last_progress;
+    std::array<std::atomic<std::int64_t>, kHistogramBuckets> latency{};
+  };
+
+  clock::time_point const start_;
+  std::vector<std::unique_ptr<stream>> streams_;
+  mutable std::mutex mu_;
+  std::vector<std::pair<clock::duration, std::int64_t>> samples_;
+};
+
+// Marks stream @p id as done when it goes out of scope, on any exit path.
+class stream_done_guard {
+ public:
+  stream_done_guard(transfer_stats& stats, int id) : stats_(stats), id_(id) {}
+  ~stream_done_guard() { stats_.stream_done(id_); }
+
+  stream_done_guard(stream_done_guard const&) = delete;
+  stream_done_guard& operator=(stream_done_guard const&) = delete;
+
+ private:
+  transfer_stats& stats_;
+  int const id_;
+};
+
+// Estimate the @p q quantile, in microseconds, from a latency histogram.
+std::int64_t histogram_quantile(transfer_stats::histogram const& h, double q);
+
+/**
+ * Periodically print the progress of a transfer.
+ *
+ * A background thread prints the aggregate and per-stream bandwidth every
+ * @p interval, and warns about streams that made no progress for
+ * @p stall_timeout. The thread stops when the reporter is destroyed.
+ */
+class progress_reporter {
+ public:
+  progress_reporter(transfer_stats& stats, std::ostream& os,
+                    std::chrono::milliseconds interval,
+                    std::chrono::milliseconds stall_timeout);
+  ~progress_reporter();
+
+  progress_reporter(progress_reporter const&) = delete;
+  progress_reporter& operator=(progress_reporter const&) = delete;
+
+ private:
+  void run();
+  void report();
+
+  transfer_stats& stats_;
+  std::ostream& os_;
+  std::chrono::milliseconds const interval_;
+  std::chrono::milliseconds const stall_timeout_;
+  transfer_stats::clock::time_point last_report_;
+  std::int64_t last_total_ = 0;
+  std::vector<std::int64_t> last_bytes_;
+  std::vector<bool> stalled_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+// Start a progress reporter, unless disabled with `--progress-interval=0`.
+std::unique_ptr<progress_reporter> make_progress_reporter(
+    transfer_stats& stats, std::ostream& os,
+    boost::program_options::variables_map const& vm);
+
+// Write the statistics, and the value of all the options in @p vm, to the
+// `--stats-json` file, if any.
+void write_stats_json(transfer_stats const& stats,
+                      boost::program_options::variables_map const& vm,
+                      transfer_stats::clock::time_point end);
+
+}  // namespace gcs_fast_transfers
+
+#endif  // GCS_FAST_TRANSFERS_TRANSFER_STATS_H
@@ -13,26 +13,398 @@
 // limitations under the License.
 
 #include "gcs_fast_transfers.h"
+#include "transfer_stats.h"
+#include "upload_state.h"
 #include <boost/program_options.hpp>
 #include <boost/uuid/random_generator.hpp>
 #include <boost/uuid/uuid_io.hpp>
+#include <crc32c/crc32c.h>
 #include <fmt/format.h>
 #include <google/cloud/storage/client.h>
-#include <google/cloud/storage/parallel_upload.h>
+#include <google/cloud/storage/compose_many.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <future>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <numeric>
+#include <optional>
+#include <regex>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+// Posix headers last.
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace {
 namespace po = boost::program_options;
 namespace gcs = google::cloud::storage;
 po::variables_map parse_command_line(int argc, char* argv[]);
+int check_system_call(std::string const& name, int result);
 
-using ::gcs_fast_transfers::file_info;
+using ::gcs_fast_transfers::combine_checksums;
+using ::gcs_fast_transfers::format_crc32c;
 using ::gcs_fast_transfers::format_size;
 using ::gcs_fast_transfers::kMiB;
+using ::gcs_fast_transfers::load_upload_state;
+using ::gcs_fast_transfers::make_progress_reporter;
+using ::gcs_fast_transfers::range_checksum;
+using ::gcs_fast_transfers::stream_done_guard;
+using ::gcs_fast_transfers::transfer_stats;
+using ::gcs_fast_transfers::upload_state;
+using ::gcs_fast_transfers::upload_state_part;
+using ::gcs_fast_transfers::upload_state_writer;
+using ::gcs_fast_transfers::write_stats_json;
+
+auto constexpr kBufferSize = std::size_t{1024 * 1024};
+
+/// A simple thread-safe queue, `pop()` blocks until an element is available
+/// or the queue is closed.
+template <typename T>
+class blocking_queue {
+ public:
+  void push(T value) {
+    std::lock_guard<std::mutex> lk(mu_);
+    queue_.push_back(std::move(value));
+    cv_.notify_one();
+  }
+
+  std::optional<T> pop() {
+    std::unique_lock<std::mutex> lk(mu_);
+    cv_.wait(lk, [this] { return closed_ || not queue_.empty(); });
+    if (queue_.empty()) return std::nullopt;
+    auto value = std::move(queue_.front());
+    queue_.pop_front();
+    return value;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lk(mu_);
+    closed_ = true;
+    cv_.notify_all();
+  }
+
+ private:
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<T> queue_;
+  bool closed_ = false;
+};
+
+/// A part of the object, uploaded as a temporary object and later composed.
+struct uploaded_part {
+  range_checksum range;
+  std::string name;
+  std::int64_t generation;
+};
+
+std::string part_name(std::string const& prefix, std::int64_t index) {
+  return fmt::format("{}.part-{:010}", prefix, index);
+}
+
+/// Upload @p data as a part object, the service verifies the checksum.
+uploaded_part upload_part(gcs::Client client, std::string const& bucket,
+                          std::string const& name, std::int64_t offset,
+                          std::string const& data) {
+  auto const crc = crc32c::Crc32c(data.data(), data.size());
+  auto metadata =
+      client
+          .InsertObject(bucket, name, data,
+                        gcs::Crc32cChecksumValue(format_crc32c(crc)),
+                        gcs::DisableMD5Hash(true))
+          .value();
+  return uploaded_part{
+      range_checksum{offset, static_cast<std::int64_t>(data.size()), crc},
+      std::move(name), metadata.generation()};
+}
+
+/// Delete the part objects, ignoring any errors.
+void delete_parts(gcs::Client client, std::string const& bucket,
+                  std::vector<uploaded_part> const& parts) {
+  for (auto const& p : parts) {
+    (void)client.DeleteObject(bucket, p.name, gcs::Generation(p.generation));
+  }
+}
+
+/**
+ * Compose the parts into @p object, and then delete them.
+ *
+ * If the compose fails the parts are not deleted, so a resumed upload can
+ * retry it.
+ */
+gcs::ObjectMetadata compose_parts(gcs::Client client,
+                                  std::string const& bucket,
+                                  std::string const& object,
+                                  std::string const& scratch_prefix,
+                                  std::vector<uploaded_part> parts) {
+  std::sort(parts.begin(), parts.end(), [](auto const& a, auto const& b) {
+    return a.range.offset < b.range.offset;
+  });
+  std::vector<gcs::ComposeSourceObject> sources;
+  for (auto const& p : parts) {
+    sources.push_back(gcs::ComposeSourceObject{p.name, p.generation, {}});
+  }
+  auto metadata = gcs::ComposeMany(client, bucket, std::move(sources),
+                                   scratch_prefix, object, false)
+                      .value();
+  delete_parts(client, bucket, parts);
+  return metadata;
+}
+
+/// Upload `[offset, offset + length)` from @p fd as a part object.
+uploaded_part upload_file_part(gcs::Client client, std::string const& bucket,
+                               std::string const& name, int fd,
+                               std::int64_t offset, std::int64_t length) {
+  // The client library computes the CRC32C of the data, and the service
+  // rejects the upload if it does not match.
+  auto os = client.WriteObject(bucket, name, gcs::DisableMD5Hash(true));
+  std::vector<char> buffer(kBufferSize);
+  std::uint32_t crc = 0;
+  for (std::int64_t count = 0; count < length;) {
+    auto const size =
+        (std::min)(static_cast<std::int64_t>(buffer.size()), length - count);
+    auto const n = check_system_call(
+        "pread()",
+        static_cast<int>(::pread(fd, buffer.data(), size, offset + count)));
+    if (n == 0) throw std::runtime_error("unexpected end of file in " + name);
+    os.write(buffer.data(), n);
+    crc = crc32c::Extend(crc, reinterpret_cast<std::uint8_t*>(buffer.data()),
+                         n);
+    count += n;
+  }
+  os.Close();
+  auto metadata = os.metadata().value();
+  return uploaded_part{range_checksum{offset, length, crc}, name,
+                       metadata.generation()};
+}
+
+/// Return true if the part recorded in a previous run exists, unchanged.
+bool part_is_valid(gcs::Client client, std::string const& bucket,
+                   std::string const& name, upload_state_part const& part,
+                   std::int64_t length) {
+  auto metadata = client.GetObjectMetadata(bucket, name,
+                                           gcs::Generation(part.generation));
+  return metadata &&
+         static_cast<std::int64_t>(metadata->size()) == length &&
+         metadata->crc32c() == format_crc32c(part.crc32c);
+}
+
+/// Return true if @p name is a part object created by an upload to @p object.
+bool is_part_name(std::string const& object, std::string const& name) {
+  // The names are `${object}.upload-${uuid}.part-${index}`, see `part_name()`.
+  static auto const suffix = std::regex(
+      R"re(\.upload-[0-9a-f]{8}(-[0-9a-f]{4}){3}-[0-9a-f]{12})re"
+      R"re(\.part-[0-9]{10})re");
+  return name.size() > object.size() &&
+         name.compare(0, object.size(), object) == 0 &&
+         std::regex_match(name.begin() + object.size(), name.end(), suffix);
+}
+
+/**
+ * Delete the part objects of interrupted uploads to @p object.
+ *
+ * If the state file records an upload to @p object, only the parts of that
+ * upload are deleted. Otherwise, the parts of any upload to @p object are
+ * deleted. Either way, only objects named like the parts are deleted.
+ */
+int cleanup(gcs::Client client, std::string const& bucket,
+            std::string const& object, std::string const& state_file) {
+  auto const saved = state_file.empty() ? std::nullopt
+                                        : load_upload_state(state_file);
+  auto const prefix = saved && saved->bucket == bucket &&
+                              saved->object == object
+                          ? saved->scratch_prefix + ".part-"
+                          : object + ".upload-";
+  std::int64_t count = 0;
+  for (auto& o : client.ListObjects(bucket, gcs::Prefix(prefix))) {
+    if (not o) throw std::runtime_error(o.status().message());
+    if (not is_part_name(object, o->name())) continue;
+    auto status = client.DeleteObject(bucket, o->name(),
+                                      gcs::Generation(o->generation()));
+    if (not status.ok()) throw std::runtime_error(status.message());
+    ++count;
+  }
+  if (not state_file.empty()) std::remove(state_file.c_str());
+  std::cout << "Removed " << count << " scratch objects with prefix " << prefix
+            << std::endl;
+  return 0;
+}
+
+/// Read up to @p buffer.size() bytes from @p fd, stopping early only at EOF.
+std::size_t read_full(int fd, std::string& buffer) {
+  std::size_t count = 0;
+  while (count < buffer.size()) {
+    auto const n = ::read(fd, buffer.data() + count, buffer.size() - count);
+    if (n < 0 && errno == EINTR) continue;
+    check_system_call("read()", static_cast<int>(n));
+    if (n == 0) break;
+    count += n;
+  }
+  return count;
+}
+
+/**
+ * Upload stdin as @p object, without storing the data in a local file.
+ *
+ * The main thread reads stdin into fixed size parts, the workers upload each
+ * part as a temporary object, and the parts are composed into the final
+ * object. The parts come from a fixed pool of buffers, sized from
+ * `--memory-limit`, the main thread stops reading when all the buffers are in
+ * use.
+ */
+int stream_upload(gcs::Client client, po::variables_map const& vm) {
+  auto const bucket = vm["bucket"].as<std::string>();
+  auto const object = vm["object"].as<std::string>();
+  auto const part_size = vm["part-size"].as<std::int64_t>();
+  auto const buffer_count = static_cast<int>((std::max)(
+      std::int64_t{1}, vm["memory-limit"].as<std::int64_t>() / part_size));
+  auto const worker_count =
+      (std::min)(buffer_count, vm["max-streams"].as<int>());
+  auto const scratch_prefix =
+      object + ".upload-" +
+      boost::uuids::to_string(boost::uuids::random_generator_mt19937{}());
+
+  std::cout << "Uploading stdin to bucket " << bucket << " as object "
+            << object << ", using " << worker_count << " streams and "
+            << buffer_count << " buffers of " << format_size(part_size)
+            << std::endl;
+
+  struct work_item {
+    std::int64_t index;
+    std::int64_t offset;
+    std::string data;
+  };
+  blocking_queue<std::string> free_buffers;
+  for (int i = 0; i != buffer_count; ++i) free_buffers.push(std::string{});
+  blocking_queue<work_item> work;
+
+  auto const start = std::chrono::steady_clock::now();
+  transfer_stats stats(worker_count);
+  auto reporter = make_progress_reporter(stats, std::cout, vm);
+  // The workers are idle while they wait for the data read from stdin.
+  auto next_item = [&](int id) {
+    stats.stream_waiting(id, true);
+    auto item = work.pop();
+    stats.stream_waiting(id, false);
+    return item;
+  };
+  auto upload_worker = [&](int id) {
+    stream_done_guard done(stats, id);
+    std::vector<uploaded_part> parts;
+    std::exception_ptr error;
+    while (auto item = next_item(id)) {
+      // After an error keep returning the buffers, so the reader can finish.
+      if (not error) {
+        try {
+          auto const upload_start = std::chrono::steady_clock::now();
+          parts.push_back(upload_part(client, bucket,
+                                      part_name(scratch_prefix, item->index),
+                                      item->offset, item->data));
+          stats.record_read(
+              id, static_cast<std::int64_t>(item->data.size()),
+              std::chrono::duration_cast<std::chrono::microseconds>(
+                  std::chrono::steady_clock::now() - upload_start));
+        } catch (...) {
+          error = std::current_exception();
+        }
+      }
+      free_buffers.push(std::move(item->data));
+    }
+    return std::make_pair(std::move(parts), error);
+  };
+  std::vector<std::future<
+      std::pair<std::vector<uploaded_part>, std::exception_ptr>>>
+      tasks;
+  for (int i = 0; i != worker_count; ++i) {
+    tasks.push_back(std::async(std::launch::async, upload_worker, i));
+  }
+
+  std::int64_t offset = 0;
+  std::exception_ptr error;
+  try {
+    for (std::int64_t index = 0;; ++index) {
+      auto buffer = *free_buffers.pop();
+      buffer.resize(part_size);
+      buffer.resize(read_full(STDIN_FILENO, buffer));
+      if (buffer.empty()) break;
+      auto const size = static_cast<std::int64_t>(buffer.size());
+      work.push(work_item{index, offset, std::move(buffer)});
+      offset += size;
+      if (size < part_size) break;
+    }
+  } catch (...) {
+    error = std::current_exception();
+  }
+  work.close();
+
+  std::vector<uploaded_part> parts;
+  for (auto& t : tasks) {
+    auto [p, e] = t.get();
+    parts.insert(parts.end(), p.begin(), p.end());
+    if (e && not error) error = e;
+  }
+  reporter.reset();
+  if (error) {
+    delete_parts(client, bucket, parts);
+    std::rethrow_exception(error);
+  }
+
+  std::vector<range_checksum> checksums;
+  for (auto const& p : parts) checksums.push_back(p.range);
+  // An empty stream has no parts, and there is nothing to compose.
+  auto metadata = [&] {
+    if (parts.empty()) {
+      return client.InsertObject(bucket, object, std::string{}).value();
+    }
+    // The upload cannot be resumed, do not leave the parts behind.
+    try {
+      return compose_parts(client, bucket, object, scratch_prefix, parts);
+    } catch (...) {
+      delete_parts(client, bucket, parts);
+      throw;
+    }
+  }();
+  auto const end = std::chrono::steady_clock::now();
+  write_stats_json(stats, vm, end);
+
+  auto const elapsed_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+  auto const elapsed_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+  auto const effective_bandwidth_MiBs =
+      (static_cast<double>(metadata.size()) / kMiB) /
+      (elapsed_us.count() / 1'000'000.0);
+  std::cout << "Upload completed in " << elapsed_ms.count() << "ms\n"
+            << "Effective bandwidth " << effective_bandwidth_MiBs << " MiB/s\n";
+
+  // The checksums of the parts cover all the data read from stdin.
+  auto [size, crc32c] = combine_checksums(std::move(checksums));
+  if (size != offset || size != static_cast<std::int64_t>(metadata.size())) {
+    std::cout << "Uploaded size mismatch, read=" << offset
+              << ", object size=" << metadata.size() << std::endl;
+    return 1;
+  }
+  if (crc32c != metadata.crc32c()) {
+    std::cout << "Uploaded CRC32C mismatch, expected=" << crc32c
+              << ", got=" << metadata.crc32c() << std::endl;
+    return 1;
+  }
+  std::cout << "Object size and CRC32C match the data read from stdin"
+            << std::endl;
+  return 0;
+}
 
 }  // namespace
 
@@ -44,22 +416,175 @@ int main(int argc, char* argv[]) try {
 
   auto client = gcs::Client::CreateDefaultClient().value();
 
+  auto const state_file = vm.count("state-file") != 0
+                              ? vm["state-file"].as<std::string>()
+                              : source + ".upload-state";
+  if (vm["cleanup"].as<bool>()) {
+    return cleanup(client, bucket, object,
+                   source == "-" && vm.count("state-file") == 0 ? ""
+                                                                : state_file);
+  }
+  if (source == "-") return stream_upload(client, vm);
+
+  struct stat st {};
+  check_system_call("stat()", ::stat(source.c_str(), &st));
+  auto const part_size = vm["part-size"].as<std::int64_t>();
+  auto const current = upload_state{
+      bucket,
+      object,
+      object + ".upload-" +
+          boost::uuids::to_string(boost::uuids::random_generator_mt19937{}()),
+      static_cast<std::int64_t>(st.st_size),
+      static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1'000'000'000 +
+          st.st_mtim.tv_nsec,
+      part_size,
+      {}};
+  // Only record the uploaded parts if the upload may be resumed, the source
+  // directory may be read-only.
+  auto const save_state =
+      vm["resume"].as<bool>() || vm.count("state-file") != 0;
+  auto const state = [&] {
+    if (not save_state) return current;
+    auto saved = load_upload_state(state_file);
+    if (not saved) {
+      std::cout << "No upload state found in " << state_file
+                << ", starting a new upload" << std::endl;
+      return current;
+    }
+    // Starting a new upload would overwrite the state file, and orphan the
+    // parts recorded in it.
+    if (not vm["resume"].as<bool>()) {
+      throw std::runtime_error(
+          "the state file " + state_file +
+          " records an interrupted upload, use --resume=true to continue it,"
+          " or --cleanup=true to remove it");
+    }
+    if (saved->bucket != bucket || saved->object != object ||
+        saved->size != current.size || saved->mtime_ns != current.mtime_ns ||
+        saved->part_size != part_size) {
+      throw std::runtime_error(
+          "the source file or options changed since the upload recorded in " +
+          state_file + ", use --cleanup=true to remove it");
+    }
+    return *std::move(saved);
+  }();
+  auto const resume = not state.parts.empty() ||
+                      state.scratch_prefix != current.scratch_prefix;
+  auto const part_count = (state.size + part_size - 1) / part_size;
+  auto const worker_count = static_cast<int>((std::min<std::int64_t>)(
+      part_count, vm["max-streams"].as<int>()));
+
   std::cout << "Uploading " << source << " to bucket " << bucket
-            << " as object " << object << " ..." << std::flush;
+            << " as object " << object << " in " << part_count
+            << " parts, using " << worker_count << " streams" << std::endl;
+  if (resume) {
+    std::cout << "Resuming upload, " << state.parts.size()
+              << " parts recorded in " << state_file << std::endl;
+  }
 
   auto const start = std::chrono::steady_clock::now();
-  auto const scratch_prefix =
-      boost::uuids::to_string(boost::uuids::random_generator_mt19937{}());
-  auto metadata =
-      gcs::ParallelUploadFile(
-          client, source, bucket, object, scratch_prefix, true,
-          gcs::MaxStreams(vm["max-streams"].as<int>()),
-          gcs::MinStreamSize(vm["minimum-stream-size"].as<std::int64_t>()))
-          .value();
+  transfer_stats stats(worker_count);
+  auto reporter = make_progress_reporter(stats, std::cout, vm);
+  std::optional<upload_state_writer> writer;
+  if (save_state) writer.emplace(state_file, state, resume);
+  auto const fd =
+      check_system_call("open()", ::open(source.c_str(), O_RDONLY));
+  std::map<std::int64_t, upload_state_part> saved_parts;
+  for (auto const& p : state.parts) saved_parts[p.index] = p;
+
+  std::atomic<std::int64_t> next_part{0};
+  std::atomic<std::int64_t> skipped{0};
+  std::atomic<bool> failed{false};
+  auto upload_worker = [&](int id) {
+    stream_done_guard done(stats, id);
+    std::vector<uploaded_part> parts;
+    try {
+      for (auto index = next_part++; index < part_count && not failed;
+           index = next_part++) {
+        auto const offset = index * part_size;
+        auto const length = (std::min)(part_size, state.size - offset);
+        auto const name = part_name(state.scratch_prefix, index);
+        auto const saved = saved_parts.find(index);
+        if (saved != saved_parts.end() &&
+            part_is_valid(client, bucket, name, saved->second, length)) {
+          parts.push_back(uploaded_part{
+              range_checksum{offset, length, saved->second.crc32c}, name,
+              saved->second.generation});
+          ++skipped;
+          continue;
+        }
+        auto const upload_start = std::chrono::steady_clock::now();
+        auto part = upload_file_part(client, bucket, name, fd, offset, length);
+        stats.record_read(
+            id, length,
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - upload_start));
+        if (writer) {
+          writer->append(upload_state_part{index, part.generation,
+                                           part.range.crc32c});
+        }
+        parts.push_back(std::move(part));
+      }
+    } catch (...) {
+      failed = true;
+      throw;
+    }
+    return parts;
+  };
+  std::vector<std::future<std::vector<uploaded_part>>> tasks;
+  for (int i = 0; i != worker_count; ++i) {
+    tasks.push_back(std::async(std::launch::async, upload_worker, i));
+  }
+  std::vector<uploaded_part> parts;
+  std::exception_ptr error;
+  for (auto& t : tasks) {
+    try {
+      auto p = t.get();
+      parts.insert(parts.end(), p.begin(), p.end());
+    } catch (...) {
+      error = std::current_exception();
+    }
+  }
+  reporter.reset();
+  check_system_call("close(fd)", ::close(fd));
+  auto const interrupted = [&] {
+    if (save_state) {
+      std::cout << "The upload was interrupted, use --resume=true to continue"
+                << " it, or --cleanup=true to remove the uploaded parts"
+                << std::endl;
+    } else {
+      std::cout << "The upload was interrupted, use --cleanup=true to remove"
+                << " the uploaded parts" << std::endl;
+    }
+  };
+  if (error) {
+    interrupted();
+    std::rethrow_exception(error);
+  }
+  if (skipped != 0) {
+    std::cout << "Reused " << skipped << " parts from the previous upload\n";
+  }
+
+  // Each part checksum was computed from the data as it was uploaded, so
+  // there is no need to read the source file again.
+  std::vector<range_checksum> checksums;
+  for (auto const& p : parts) checksums.push_back(p.range);
+  auto metadata = [&] {
+    if (parts.empty()) {
+      return client.InsertObject(bucket, object, std::string{}).value();
+    }
+    try {
+      return compose_parts(client, bucket, object, state.scratch_prefix,
+                           std::move(parts));
+    } catch (...) {
+      interrupted();
+      throw;
+    }
+  }();
+  if (save_state) std::remove(state_file.c_str());
   auto const end = std::chrono::steady_clock::now();
+  write_stats_json(stats, vm, end);
 
-  std::cout << "DONE"
-            << "\n";
   std::cout << "The upload was successful, the object size is approximately "
             << format_size(metadata.size()) << "\n";
 
@@ -73,15 +598,18 @@ int main(int argc, char* argv[]) try {
   std::cout << "Upload completed in " << elapsed_ms.count() << "ms\n"
             << "Effective bandwidth " << effective_bandwidth_MiBs << " MiB/s\n";
 
-  auto [size, crc32c] = file_info(source);
-  if (size != metadata.size()) {
-    std::cout << "Uploaded file size mismatch, expected=" << metadata.size()
-              << ", got=" << size << std::endl;
+  // Compare against the source size too, in case some parts are missing.
+  auto [size, crc32c] = combine_checksums(std::move(checksums));
+  if (size != state.size ||
+      static_cast<std::int64_t>(metadata.size()) != state.size) {
+    std::cout << "Uploaded file size mismatch, expected=" << state.size
+              << ", parts size=" << size
+              << ", object size=" << metadata.size() << std::endl;
     return 1;
   }
 
   if (crc32c != metadata.crc32c()) {
-    std::cout << "Download file CRC32C mismatch, expected=" << metadata.crc32c()
+    std::cout << "Uploaded file CRC32C mismatch, expected=" << metadata.crc32c()
               << ", got=" << crc32c << std::endl;
     return 1;
   }
@@ -124,7 +652,8 @@ char const* kPositional[] = {"source", "bucket", "object"};
 }
 
 po::variables_map parse_command_line(int argc, char* argv[]) {
-  auto const default_min_stream_size = 64 * 1024 * 1024L;
+  auto const default_part_size = 32 * 1024 * 1024L;
+  auto const default_memory_limit = 1024 * 1024 * 1024L;
   auto const default_max_streams = [] {
     auto constexpr kFallbackStreamCount = 4;
     auto constexpr kStreamsPerCore = 4;
@@ -140,7 +669,8 @@ po::variables_map parse_command_line(int argc, char* argv[]) {
   desc.add_options()("help", "produce help message")
       //
       ("source", po::value<std::string>()->required(),
-       "set the object file to upload")
+       "set the object file to upload, use `-` to upload the data read from "
+       "stdin")
       //
       ("bucket", po::value<std::string>()->required(),
        "set the GCS bucket to upload to")
@@ -151,9 +681,38 @@ po::variables_map parse_command_line(int argc, char* argv[]) {
       ("max-streams", po::value<int>()->default_value(default_max_streams),
        "number of parallel streams for the upload")
       //
-      ("minimum-stream-size",
-       po::value<std::int64_t>()->default_value(default_min_stream_size),
-       "minimum slice size");
+      ("part-size",
+       po::value<std::int64_t>()->default_value(default_part_size),
+       "size of each part, the parts are uploaded in parallel and then "
+       "composed into the destination object")
+      //
+      ("memory-limit",
+       po::value<std::int64_t>()->default_value(default_memory_limit),
+       "approximate limit for the data buffered when uploading from stdin, "
+       "this limits the number of parts uploaded in parallel")
+      //
+      ("resume", po::value<bool>()->default_value(false),
+       "record the uploaded parts in the state file, and continue an "
+       "interrupted upload, reusing the parts recorded in it")
+      //
+      ("state-file", po::value<std::string>(),
+       "the file recording the uploaded parts, defaults to the source file "
+       "name with a `.upload-state` suffix, the parts are only recorded with "
+       "--resume=true or an explicit --state-file")
+      //
+      ("cleanup", po::value<bool>()->default_value(false),
+       "instead of uploading, delete the temporary objects left by any "
+       "interrupted uploads to the destination object, and the state file")
+      //
+      ("progress-interval", po::value<int>()->default_value(5),
+       "print the aggregate and per-stream bandwidth every this many "
+       "seconds, use 0 to disable the progress reports")
+      //
+      ("stall-timeout", po::value<int>()->default_value(60),
+       "report streams that upload no part for this many seconds as stalled")
+      //
+      ("stats-json", po::value<std::string>(),
+       "write the upload bandwidth to this file, in JSON format");
 
   // parse the input into the map
   po::variables_map vm;
@@ -179,14 +738,34 @@ po::variables_map parse_command_line(int argc, char* argv[]) {
     usage(argv[0], desc, fmt::format("the {} argument cannot be empty", opt));
   }
 
-  if (vm["max-streams"].as<int>() == 0) {
-    usage(argv[0], desc, "the --max-streams option cannot be zero");
+  if (vm["max-streams"].as<int>() <= 0) {
+    usage(argv[0], desc, "the --max-streams option must be positive");
   }
-  if (vm["minimum-stream-size"].as<std::int64_t>() == 0) {
-    usage(argv[0], desc, "the --minimum-stream-size option cannot be zero");
+  if (vm["source"].as<std::string>() == "-" && vm["resume"].as<bool>()) {
+    usage(argv[0], desc, "cannot use --resume when uploading from stdin");
+  }
+  if (vm["part-size"].as<std::int64_t>() <= 0) {
+    usage(argv[0], desc, "the --part-size option must be positive");
+  }
+  if (vm["memory-limit"].as<std::int64_t>() <= 0) {
+    usage(argv[0], desc, "the --memory-limit option must be positive");
+  }
+  if (vm["progress-interval"].as<int>() < 0) {
+    usage(argv[0], desc, "the --progress-interval option cannot be negative");
+  }
+  if (vm["stall-timeout"].as<int>() <= 0) {
+    usage(argv[0], desc, "the --stall-timeout option must be positive");
   }
 
   return vm;
 }
 
+int check_system_call(std::string const& name, int result) {
+  if (result >= 0) return result;
+  auto err = errno;
+  throw std::runtime_error(
+      fmt::format("Error in {}() - return value={}, error=[{}] {}", name,
+                  result, err, strerror(err)));
+}
+
 }  // namespace
@@ -0,0 +1,86 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "upload_state.h"
+#include <sstream>
+#include <stdexcept>
+
+namespace gcs_fast_transfers {
+namespace {
+// The state is a text file. The first line identifies the source file, the
+// next three lines contain the bucket, object, and scratch prefix (GCS object
+// names cannot contain newlines), and each following line records an uploaded
+// part as `index generation crc32c end`, with the checksum in hex.
+auto constexpr kStateHeader = "gcs-fast-transfers-upload-state-v1";
+auto constexpr kRecordEnd = "end";
+}  // namespace
+
+std::optional<upload_state> load_upload_state(std::string const& filename) {
+  std::ifstream is(filename);
+  std::string line;
+  if (not std::getline(is, line)) return std::nullopt;
+
+  std::istringstream header(line);
+  std::string tag;
+  upload_state state{{}, {}, {}, 0, 0, 0, {}};
+  if (not(header >> tag >> state.size >> state.mtime_ns >> state.part_size) ||
+      tag != kStateHeader || state.part_size <= 0) {
+    return std::nullopt;
+  }
+  if (not std::getline(is, state.bucket) ||
+      not std::getline(is, state.object) ||
+      not std::getline(is, state.scratch_prefix)) {
+    return std::nullopt;
+  }
+  auto const part_count = (state.size + state.part_size - 1) / state.part_size;
+  while (std::getline(is, line)) {
+    std::istringstream record(line);
+    upload_state_part p{0, 0, 0};
+    std::string end;
+    if (not(record >> p.index >> p.generation >> std::hex >> p.crc32c >>
+            end) ||
+        end != kRecordEnd) {
+      continue;
+    }
+    if (p.index < 0 || p.index >= part_count) continue;
+    state.parts.push_back(p);
+  }
+  return state;
+}
+
+upload_state_writer::upload_state_writer(std::string const& filename,
+                                         upload_state const& state,
+                                         bool resume)
+    : os_(filename, resume ? std::ios::app : std::ios::trunc) {
+  if (not os_) throw std::runtime_error("cannot open upload state " + filename);
+  // Terminate any record torn when the previous upload was interrupted.
+  if (resume) {
+    os_ << std::endl;
+    return;
+  }
+  os_ << kStateHeader << ' ' << state.size << ' ' << state.mtime_ns << ' '
+      << state.part_size << '\n'
+      << state.bucket << '\n'
+      << state.object << '\n'
+      << state.scratch_prefix << std::endl;
+}
+
+void upload_state_writer::append(upload_state_part const& p) {
+  std::lock_guard<std::mutex> lk(mu_);
+  os_ << p.index << ' ' << p.generation << ' ' << std::hex << p.crc32c
+      << std::dec << ' ' << kRecordEnd << std::endl;
+  if (not os_) throw std::runtime_error("error writing upload state");
+}
+
+}  // namespace gcs_fast_transfers
@@ -0,0 +1,74 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GCS_FAST_TRANSFERS_UPLOAD_STATE_H
+#define GCS_FAST_TRANSFERS_UPLOAD_STATE_H
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace gcs_fast_transfers {
+
+// A part of an upload, stored as a temporary object until it is composed.
+struct upload_state_part {
+  std::int64_t index;
+  std::int64_t generation;
+  std::uint32_t crc32c;
+};
+
+// The persisted state of a parallel upload.
+struct upload_state {
+  std::string bucket;
+  std::string object;
+  // The part objects are named `${scratch_prefix}.part-${index}`.
+  std::string scratch_prefix;
+  // The size and modification time of the source file, in nanoseconds, used
+  // to detect changes before resuming.
+  std::int64_t size;
+  std::int64_t mtime_ns;
+  std::int64_t part_size;
+  std::vector<upload_state_part> parts;
+};
+
+// Load the upload state, returns std::nullopt if the file does not exist or
+// has an invalid header. A truncated last record is ignored.
+std::optional<upload_state> load_upload_state(std::string const& filename);
+
+/**
+ * Records the parts of an upload as they complete.
+ *
+ * Like `download_journal_writer`, each record is flushed as soon as it is
+ * appended, and appending records is thread-safe.
+ */
+class upload_state_writer {
+ public:
+  // Append to an existing state file if @p resume is true, otherwise start a
+  // new file using the header fields of @p state.
+  upload_state_writer(std::string const& filename, upload_state const& state,
+                      bool resume);
+
+  void append(upload_state_part const& p);
+
+ private:
+  std::mutex mu_;
+  std::ofstream os_;
+};
+
+}  // namespace gcs_fast_transfers
+
+#endif  // GCS_FAST_TRANSFERS_UPLOAD_STATE_H
@@ -0,0 +1,286 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gcs_fast_transfers.h"
+#include "io_engine.h"
+#include <boost/program_options.hpp>
+#include <fmt/format.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+// Posix headers last.
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+namespace po = boost::program_options;
+po::variables_map parse_command_line(int argc, char* argv[]);
+int check_system_call(std::string const& name, int result);
+
+using ::gcs_fast_transfers::format_size;
+using ::gcs_fast_transfers::io_engine_supported;
+using ::gcs_fast_transfers::kDirectIoAlignment;
+using ::gcs_fast_transfers::kIoEngineNames;
+using ::gcs_fast_transfers::kMiB;
+using ::gcs_fast_transfers::kPreallocateNames;
+using ::gcs_fast_transfers::make_io_engine;
+using ::gcs_fast_transfers::preallocate;
+using ::gcs_fast_transfers::preallocate_supported;
+
+auto constexpr kBufferSize = std::size_t{1024 * 1024};
+
+// Write `[offset, offset + length)` using copies of `data`, the way download
+// copies the data received from GCS into each buffer.
+void write_slice(std::string const& engine_name, std::string const& filename,
+                 int fd, int queue_depth, std::int64_t sync_interval,
+                 std::vector<char> const& data, std::int64_t offset,
+                 std::int64_t length) {
+  auto engine = make_io_engine(engine_name, filename, fd, kBufferSize,
+                               queue_depth, sync_interval);
+  for (auto end = offset + length; offset < end;) {
+    auto const n = (std::min)(static_cast<std::int64_t>(data.size()),
+                              end - offset);
+    auto* buffer = engine->allocate();
+    std::memcpy(buffer, data.data(), n);
+    engine->write(buffer, n, offset);
+    offset += n;
+  }
+  engine->flush();
+}
+
+// The configuration of each run.
+struct config {
+  std::string engine_name;
+  std::string preallocate;
+  std::int64_t sync_interval;
+};
+
+void run(config const& cfg, po::variables_map const& vm,
+         std::vector<char> const& data) {
+  auto const filename = vm["destination"].as<std::string>();
+  auto const file_size = vm["file-size"].as<std::int64_t>();
+  auto const thread_count = vm["thread-count"].as<int>();
+  auto const queue_depth = vm["io-queue-depth"].as<int>();
+
+  auto const start = std::chrono::steady_clock::now();
+  auto constexpr kOpenFlags = O_CREAT | O_TRUNC | O_WRONLY;
+  auto constexpr kOpenMode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
+  auto const fd = check_system_call(
+      "open()", ::open(filename.c_str(), kOpenFlags, kOpenMode));
+  // The preallocation is included in the measured time, as it is part of the
+  // download time too.
+  auto const preallocated = preallocate(fd, file_size, cfg.preallocate);
+
+  // Use aligned slices, as download does.
+  auto const slice =
+      file_size / thread_count / kDirectIoAlignment * kDirectIoAlignment;
+  std::vector<std::future<void>> tasks;
+  for (int i = 0; i != thread_count; ++i) {
+    auto const offset = i * slice;
+    auto const length = i + 1 == thread_count ? file_size - offset : slice;
+    tasks.push_back(std::async(std::launch::async, write_slice,
+                               cfg.engine_name, filename, fd, queue_depth,
+                               cfg.sync_interval, std::cref(data), offset,
+                               length));
+  }
+  for (auto& t : tasks) t.get();
+  // Include the time to flush the page cache, otherwise the buffered engines
+  // look faster than they are.
+  if (vm["fsync"].as<bool>()) check_system_call("fsync(fd)", ::fsync(fd));
+  check_system_call("close(fd)", ::close(fd));
+  auto const end = std::chrono::steady_clock::now();
+
+  auto const elapsed_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+  auto const bandwidth_MiBs = (static_cast<double>(file_size) / kMiB) /
+                              (elapsed_us.count() / 1'000'000.0);
+  std::cout << fmt::format("{},{},{},{},{},{},{},{:.2f}", cfg.engine_name,
+                           preallocated, cfg.sync_interval, thread_count,
+                           queue_depth, file_size, elapsed_us.count() / 1000,
+                           bandwidth_MiBs)
+            << std::endl;
+  std::remove(filename.c_str());
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) try {
+  auto vm = parse_command_line(argc, argv);
+
+  std::cout << "# Writing " << format_size(vm["file-size"].as<std::int64_t>())
+            << " of synthetic data to " << vm["destination"].as<std::string>()
+            << "\n";
+  std::vector<char> data(kBufferSize);
+  std::generate(data.begin(), data.end(),
+                [g = std::mt19937_64(std::random_device{}())]() mutable {
+                  return static_cast<char>(g());
+                });
+
+  std::cout << "IoEngine,Preallocate,SyncInterval,ThreadCount,QueueDepth,"
+            << "Size,ElapsedMs,MiBs" << std::endl;
+  for (int i = 0; i != vm["iterations"].as<int>(); ++i) {
+    for (auto const& engine : vm["io-engine"].as<std::vector<std::string>>()) {
+      for (auto const& method :
+           vm["preallocate"].as<std::vector<std::string>>()) {
+        for (auto interval :
+             vm["sync-interval"].as<std::vector<std::int64_t>>()) {
+          run(config{engine, method, interval}, vm, data);
+        }
+      }
+    }
+  }
+
+  return 0;
+} catch (std::exception const& ex) {
+  std::cerr << "Standard C++ exception thrown: " << ex.what() << std::endl;
+  return 1;
+} catch (...) {
+  std::cerr << "Unknown C++ exception thrown" << std::endl;
+  return 1;
+}
+
+namespace {
+
+[[noreturn]] void usage(std::string const& argv0,
+                        po::options_description const& desc,
+                        std::string const& message = {}) {
+  auto exit_status = EXIT_SUCCESS;
+  if (not message.empty()) {
+    exit_status = EXIT_FAILURE;
+    std::cout << "Error: " << message << "\n";
+  }
+
+  // print usage + options help, and exit normally
+  std::cout << "usage: " << argv0 << " [options]\n\n" << desc << "\n";
+  std::exit(exit_status);
+}
+
+po::variables_map parse_command_line(int argc, char* argv[]) {
+  auto const default_file_size = 4 * gcs_fast_transfers::kGiB;
+  auto const default_thread_count = [] {
+    auto constexpr kFallbackThreadCount = 2;
+    auto constexpr kThreadsPerCore = 2;
+    auto const count = std::thread::hardware_concurrency();
+    if (count == 0) return kFallbackThreadCount;
+    return static_cast<int>(count * kThreadsPerCore);
+  }();
+  std::vector<std::string> default_engines;
+  std::copy_if(std::begin(kIoEngineNames), std::end(kIoEngineNames),
+               std::back_inserter(default_engines), io_engine_supported);
+  auto const default_engines_text =
+      std::accumulate(std::next(default_engines.begin()), default_engines.end(),
+                      default_engines.front(),
+                      [](auto a, auto const& b) { return a + " " + b; });
+  std::vector<std::string> const default_preallocate(
+      std::begin(kPreallocateNames), std::end(kPreallocateNames));
+
+  po::options_description desc(
+      "Compare the I/O engines and preallocation methods used by download, "
+      "writing synthetic data to a local file");
+  desc.add_options()("help", "produce help message")
+      //
+      ("destination",
+       po::value<std::string>()->default_value("write-benchmark.bin"),
+       "the file to write, it is removed after each run")
+      //
+      ("file-size",
+       po::value<std::int64_t>()->default_value(default_file_size),
+       "the number of bytes to write")
+      //
+      ("thread-count", po::value<int>()->default_value(default_thread_count),
+       "number of threads writing to the file")
+      //
+      ("io-engine",
+       po::value<std::vector<std::string>>()->multitoken()->default_value(
+           default_engines, default_engines_text),
+       "the I/O engines to compare")
+      //
+      ("io-queue-depth", po::value<int>()->default_value(8),
+       "number of buffers, and writes in flight, per thread with "
+       "--io-engine=uring")
+      //
+      ("preallocate",
+       po::value<std::vector<std::string>>()->multitoken()->default_value(
+           default_preallocate, "none sparse fallocate"),
+       "the preallocation methods to compare")
+      //
+      ("sync-interval",
+       po::value<std::vector<std::int64_t>>()->multitoken()->default_value(
+           {0}, "0"),
+       "the --sync-interval values to compare, 0 leaves the write-back to "
+       "the kernel")
+      //
+      ("fsync", po::value<bool>()->default_value(true),
+       "include an fsync() in the measured time")
+      //
+      ("iterations", po::value<int>()->default_value(1),
+       "number of times to run each engine");
+
+  po::variables_map vm;
+  try {
+    po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+    po::notify(vm);
+  } catch (std::exception const& ex) {
+    usage(argv[0], desc, ex.what());
+  }
+
+  if (vm.count("help") != 0) usage(argv[0], desc);
+
+  if (vm["file-size"].as<std::int64_t>() <= 0) {
+    usage(argv[0], desc, "the --file-size option must be positive");
+  }
+  if (vm["thread-count"].as<int>() <= 0) {
+    usage(argv[0], desc, "the --thread-count option must be positive");
+  }
+  if (vm["io-queue-depth"].as<int>() <= 0) {
+    usage(argv[0], desc, "the --io-queue-depth option must be positive");
+  }
+  for (auto const& engine : vm["io-engine"].as<std::vector<std::string>>()) {
+    if (io_engine_supported(engine)) continue;
+    usage(argv[0], desc, fmt::format("unsupported --io-engine {}", engine));
+  }
+  for (auto const& method : vm["preallocate"].as<std::vector<std::string>>()) {
+    if (preallocate_supported(method)) continue;
+    usage(argv[0], desc, fmt::format("unsupported --preallocate {}", method));
+  }
+  for (auto interval : vm["sync-interval"].as<std::vector<std::int64_t>>()) {
+    if (interval >= 0) continue;
+    usage(argv[0], desc, "the --sync-interval values cannot be negative");
+  }
+
+  return vm;
+}
+
+int check_system_call(std::string const& name, int result) {
+  if (result >= 0) return result;
+  auto err = errno;
+  throw std::runtime_error(
+      fmt::format("Error in {}() - return value={}, error=[{}] {}", name,
+                  result, err, strerror(err)));
+}
+
+}  // namespace
@@ -22,6 +22,13 @@
 
 namespace google::cloud::cpp_samples {
 
+// Spanner limits a commit to 20,000 mutations, where each modified column
+// counts as a separate "mutation".
+auto constexpr kSpannerMutationLimit = 20'000UL;
+// Spanner recommends changing at most "a few hundred rows" at a time:
+//   https://cloud.google.com/spanner/docs/bulk-loading
+auto constexpr kEfficientRowLimit = 512UL;
+
 std::size_t ColumnCount();
 
 google::cloud::spanner::Mutation UpdateObjectMetadata(
@@ -22,9 +22,14 @@
 #include <nlohmann/json.hpp>
 #include <algorithm>
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace {
 
@@ -36,50 +41,60 @@ using google::cloud::promise;
 using google::cloud::Status;
 using google::cloud::cpp_samples::ColumnCount;
 using google::cloud::cpp_samples::GetEnv;
+using google::cloud::cpp_samples::kEfficientRowLimit;
+using google::cloud::cpp_samples::kSpannerMutationLimit;
 using google::cloud::cpp_samples::UpdateObjectMetadata;
 
+// Batch the mutations and commit them using a fixed pool of worker threads.
+//
+// Full batches wait in a bounded queue until a worker is available. When the
+// queue is full `Push()` blocks, which pushes back on the Pub/Sub handlers.
 class MutationBatcher {
  public:
   MutationBatcher(spanner::Client client);
+  ~MutationBatcher();
 
   future<Status> Push(gcs::ObjectMetadata const& o);
   // Return the number of mutations processed since the last Flush().
   std::int64_t Flush();
 
-  void ReapBackgroundTasks();
-
  private:
-  void FlushIfNeeded(std::unique_lock<std::mutex> const&);
-  void Flush(std::unique_lock<std::mutex> const&);
-
   struct Item {
     spanner::Mutation mutation;
     promise<Status> done;
   };
 
+  void FlushIfNeeded(std::unique_lock<std::mutex>&);
+  void Flush(std::unique_lock<std::mutex>&);
+  void CommitLoop();
+  void Commit(std::vector<Item> items);
+
   spanner::Client client_;
   std::mutex mu_;
+  std::condition_variable has_work_;
+  std::condition_variable has_room_;
   std::vector<Item> items_;
-  std::vector<std::future<void>> background_tasks_;
+  std::deque<std::vector<Item>> batches_;
+  bool shutdown_ = false;
   std::int64_t mutation_count_ = 0;
+  std::vector<std::thread> workers_;
 };
 
 void IndexGcsPrefix(pubsub::Message m, pubsub::AckHandler h, gcs::Client client,
                     pubsub::Publisher publisher,
                     std::shared_ptr<MutationBatcher> batcher);
 
-// Spanner limits a commit to 20,000 mutations, where each modified column
-// counts as a separate "mutation".
-auto constexpr kSpannerMutationLimit = 20'000UL;
-// Spanner recommends changing at most "a few hundred rows" at a time:
-//   https://cloud.google.com/spanner/docs/bulk-loading
-auto constexpr kEfficientRowLimit = 512UL;
 // The Cloud Pub/Sub service can flow control how many messages
 // are delivered to each subscriber.
 auto constexpr kMaxOutstandingMessages = 128;
 // The Cloud Pub/Sub library can be configured to limit the number of
 // messages that are not ack or nacked by the application.
 auto constexpr kMaxConcurrency = 256;
+// Commit (at most) this many batches in parallel, each commit blocks a
+// worker thread.
+auto constexpr kCommitWorkerCount = 32;
+// Queue (at most) this many batches waiting for a commit worker.
+auto constexpr kMaxQueuedBatches = 64UL;
 
 }  // namespace
 
@@ -155,13 +170,28 @@ void LogError(std::string const& msg) {
 }
 
 MutationBatcher::MutationBatcher(spanner::Client client)
-    : client_(std::move(client)) {}
+    : client_(std::move(client)) {
+  for (int i = 0; i != kCommitWorkerCount; ++i) {
+    workers_.emplace_back([this] { CommitLoop(); });
+  }
+}
+
+MutationBatcher::~MutationBatcher() {
+  {
+    std::unique_lock lk(mu_);
+    Flush(lk);
+    shutdown_ = true;
+  }
+  has_work_.notify_all();
+  for (auto& w : workers_) w.join();
+}
 
 future<Status> MutationBatcher::Push(gcs::ObjectMetadata const& o) {
+  auto mutation = UpdateObjectMetadata(o);
   std::unique_lock lk(mu_);
   // Make room for the new data.
   FlushIfNeeded(lk);
-  items_.push_back(Item{UpdateObjectMetadata(o), promise<Status>{}});
+  items_.push_back(Item{std::move(mutation), promise<Status>{}});
   return items_.back().done.get_future();
 }
 
@@ -173,39 +203,45 @@ std::int64_t MutationBatcher::Flush() {
   return n;
 }
 
-void MutationBatcher::ReapBackgroundTasks() {
-  std::unique_lock lk(mu_);
-  // Remove any tasks that have completed. This would not be needed if
-  // we had a fully asynchronous `AsyncCommit()` function in Cloud Spanner.
-  background_tasks_.erase(
-      std::remove_if(background_tasks_.begin(), background_tasks_.end(),
-                     [](auto& t) {
-                       using namespace std::chrono_literals;
-                       return t.wait_for(10ms) == std::future_status::ready;
-                     }),
-      background_tasks_.end());
+void MutationBatcher::FlushIfNeeded(std::unique_lock<std::mutex>& lk) {
+  // Flush() may wait for room in the queue, and other threads may flush the
+  // items in the meantime.
+  while (items_.size() >= kEfficientRowLimit ||
+         items_.size() * ColumnCount() >= kSpannerMutationLimit) {
+    Flush(lk);
+  }
 }
 
-void MutationBatcher::FlushIfNeeded(std::unique_lock<std::mutex> const& lk) {
-  if (items_.size() >= kEfficientRowLimit) return Flush(lk);
-  if (items_.size() * ColumnCount() >= kSpannerMutationLimit) return Flush(lk);
+void MutationBatcher::Flush(std::unique_lock<std::mutex>& lk) {
+  if (items_.empty()) return;
+  has_room_.wait(lk, [this] { return batches_.size() < kMaxQueuedBatches; });
+  if (items_.empty()) return;
+  mutation_count_ += items_.size();
+  batches_.push_back(std::move(items_));
+  items_.clear();
+  has_work_.notify_one();
 }
 
-void MutationBatcher::Flush(std::unique_lock<std::mutex> const&) {
-  if (items_.empty()) return;
-  std::vector<Item> items;
-  items.swap(items_);
-  mutation_count_ += items.size();
-  background_tasks_.push_back(std::async(
-      std::launch::async,
-      [](spanner::Client client, std::vector<Item> items) {
-        std::vector<spanner::Mutation> mutations(items.size());
-        std::transform(items.begin(), items.end(), mutations.begin(),
-                       [](auto& i) { return std::move(i.mutation); });
-        auto commit_result = client.Commit(std::move(mutations));
-        for (auto& i : items) i.done.set_value(commit_result.status());
-      },
-      client_, std::move(items)));
+void MutationBatcher::CommitLoop() {
+  std::unique_lock lk(mu_);
+  for (;;) {
+    has_work_.wait(lk, [this] { return shutdown_ || !batches_.empty(); });
+    if (batches_.empty()) return;
+    auto items = std::move(batches_.front());
+    batches_.pop_front();
+    has_room_.notify_one();
+    lk.unlock();
+    Commit(std::move(items));
+    lk.lock();
+  }
+}
+
+void MutationBatcher::Commit(std::vector<Item> items) {
+  std::vector<spanner::Mutation> mutations(items.size());
+  std::transform(items.begin(), items.end(), mutations.begin(),
+                 [](auto& i) { return std::move(i.mutation); });
+  auto commit_result = client_.Commit(std::move(mutations));
+  for (auto& i : items) i.done.set_value(commit_result.status());
 }
 
 template <typename T>
@@ -269,10 +305,15 @@ void IndexGcsPrefix(pubsub::Message m, pubsub::AckHandler h, gcs::Client client,
     if (i == attributes.end()) return gcs::StartOffset();
     return gcs::StartOffset(i->second);
   }();
+  auto const end = [&attributes] {
+    auto i = attributes.find("end");
+    if (i == attributes.end()) return gcs::EndOffset();
+    return gcs::EndOffset(i->second);
+  }();
 
   std::vector<google::cloud::future<google::cloud::Status>> pending;
-  for (auto const& entry : client.ListObjectsAndPrefixes(bucket, prefix, start,
-                                                         gcs::Delimiter("/"))) {
+  for (auto const& entry : client.ListObjectsAndPrefixes(
+           bucket, prefix, start, end, gcs::Delimiter("/"))) {
     ThrowIfNotOkay("listing bucket " + bucket, entry.status());
     if (std::chrono::steady_clock::now() >= deadline) {
       std::string start = absl::visit(
@@ -287,6 +328,7 @@ void IndexGcsPrefix(pubsub::Message m, pubsub::AckHandler h, gcs::Client client,
       if (prefix.has_value()) {
         builder.InsertAttribute("prefix", prefix.value());
       }
+      if (end.has_value()) builder.InsertAttribute("end", end.value());
       pending.push_back(
           publisher.Publish(std::move(builder).Build()).then([](auto f) {
             return f.get().status();
@@ -331,12 +373,6 @@ void IndexGcsPrefix(pubsub::Message m, pubsub::AckHandler h, gcs::Client client,
           break;
         }
         LogError(std::move(os).str());
-      })
-      .then([batcher](auto f) {
-        // Once the operations (including any writes to Cloud Spanner) have
-        // completed we cleanup the background tasks that might have been
-        // created to satisfy the request.
-        batcher->ReapBackgroundTasks();
       });
 }
 
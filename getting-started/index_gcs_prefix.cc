@@ -19,9 +19,17 @@
 #include <google/cloud/spanner/client.h>
 #include <google/cloud/storage/client.h>
 #include <nlohmann/json.hpp>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace {
 
@@ -29,9 +37,26 @@ namespace gcf = ::google::cloud::functions;
 namespace gcs = ::google::cloud::storage;
 namespace pubsub = ::google::cloud::pubsub;
 namespace spanner = ::google::cloud::spanner;
+using google::cloud::future;
+using google::cloud::Status;
+using google::cloud::cpp_samples::ColumnCount;
 using google::cloud::cpp_samples::GetEnv;
+using google::cloud::cpp_samples::kEfficientRowLimit;
+using google::cloud::cpp_samples::kSpannerMutationLimit;
 using google::cloud::cpp_samples::UpdateObjectMetadata;
 
+// Each request lists (at most) this many entries before deciding if the
+// prefix is large enough to list in parallel. This is a single page in the
+// GCS listing API.
+auto constexpr kSampleSize = 1000;
+// Large prefixes are split in (at most) this many ranges, listed in parallel.
+auto constexpr kMaxListingRanges = 16;
+// Each request commits (at most) this many batches in parallel, each commit
+// blocks a worker thread.
+auto constexpr kCommitWorkerCount = 8;
+// Queue (at most) this many batches waiting for a commit worker.
+auto constexpr kMaxQueuedBatches = 8UL;
+
 pubsub::Publisher GetPublisher() {
   static auto const publisher = [&] {
     auto topic =
@@ -71,6 +96,247 @@ gcf::HttpResponse LogError(std::string const& msg) {
       .set_payload(msg);
 }
 
+// Batch the mutations for a request, and commit each batch in the background.
+//
+// There is no asynchronous `Commit()` function in Cloud Spanner, so a small
+// pool of worker threads commits the batches. Once too many batches are
+// waiting for a worker `Push()` blocks, the commits in progress continue.
+class CommitBatcher {
+ public:
+  explicit CommitBatcher(spanner::Client client);
+  ~CommitBatcher();
+
+  void Push(spanner::Mutation m);
+  // Commit any pending mutations, wait for all the commits to complete, and
+  // return the first error, if any.
+  Status Finish();
+
+ private:
+  void Flush(std::unique_lock<std::mutex>&);
+  void CommitLoop();
+
+  spanner::Client client_;
+  std::mutex mu_;
+  std::condition_variable has_work_;
+  std::condition_variable has_room_;
+  std::condition_variable is_idle_;
+  spanner::Mutations mutations_;
+  std::deque<spanner::Mutations> batches_;
+  int active_commits_ = 0;
+  bool shutdown_ = false;
+  Status status_;
+  std::vector<std::thread> workers_;
+};
+
+CommitBatcher::CommitBatcher(spanner::Client client)
+    : client_(std::move(client)) {
+  for (int i = 0; i != kCommitWorkerCount; ++i) {
+    workers_.emplace_back([this] { CommitLoop(); });
+  }
+}
+
+CommitBatcher::~CommitBatcher() {
+  {
+    std::unique_lock lk(mu_);
+    Flush(lk);
+    shutdown_ = true;
+  }
+  has_work_.notify_all();
+  for (auto& w : workers_) w.join();
+}
+
+void CommitBatcher::Push(spanner::Mutation m) {
+  std::unique_lock lk(mu_);
+  // Make room for the new data.
+  if (mutations_.size() >= kEfficientRowLimit ||
+      mutations_.size() * ColumnCount() >= kSpannerMutationLimit) {
+    Flush(lk);
+  }
+  mutations_.push_back(std::move(m));
+}
+
+Status CommitBatcher::Finish() {
+  std::unique_lock lk(mu_);
+  Flush(lk);
+  is_idle_.wait(lk,
+                [this] { return batches_.empty() && active_commits_ == 0; });
+  return status_;
+}
+
+void CommitBatcher::Flush(std::unique_lock<std::mutex>& lk) {
+  if (mutations_.empty()) return;
+  has_room_.wait(lk, [this] { return batches_.size() < kMaxQueuedBatches; });
+  // Another thread may have flushed the mutations while this one waited.
+  if (mutations_.empty()) return;
+  batches_.push_back(std::move(mutations_));
+  mutations_.clear();
+  has_work_.notify_one();
+}
+
+void CommitBatcher::CommitLoop() {
+  std::unique_lock lk(mu_);
+  for (;;) {
+    has_work_.wait(lk, [this] { return shutdown_ || !batches_.empty(); });
+    if (batches_.empty()) return;
+    auto mutations = std::move(batches_.front());
+    batches_.pop_front();
+    ++active_commits_;
+    has_room_.notify_one();
+    lk.unlock();
+    auto status = client_.Commit(std::move(mutations)).status();
+    lk.lock();
+    if (status_.ok()) status_ = std::move(status);
+    if (--active_commits_ == 0 && batches_.empty()) is_idle_.notify_all();
+  }
+}
+
+struct EntryName {
+  std::string operator()(std::string const& s) { return s; }
+  std::string operator()(gcs::ObjectMetadata const& o) { return o.name(); }
+};
+
+// The parameters shared by all the ranges listed in a request.
+struct ListingContext {
+  gcs::Client client;
+  pubsub::Publisher publisher;
+  std::string bucket;
+  gcs::Prefix prefix;
+  gcs::EndOffset end;
+  std::chrono::steady_clock::time_point deadline;
+  std::shared_ptr<CommitBatcher> batcher;
+};
+
+struct ListingResult {
+  std::int64_t mutation_count = 0;
+  std::vector<future<Status>> pending;
+};
+
+void Merge(ListingResult& result, ListingResult r) {
+  result.mutation_count += r.mutation_count;
+  std::move(r.pending.begin(), r.pending.end(),
+            std::back_inserter(result.pending));
+}
+
+// Schedule a new request to index the entries in [start, ctx.end).
+future<Status> PublishRange(ListingContext& ctx, std::string start) {
+  auto builder = pubsub::MessageBuilder{}
+                     .InsertAttribute("bucket", ctx.bucket)
+                     .InsertAttribute("start", std::move(start));
+  if (ctx.prefix.has_value()) {
+    builder.InsertAttribute("prefix", ctx.prefix.value());
+  }
+  if (ctx.end.has_value()) builder.InsertAttribute("end", ctx.end.value());
+  return ctx.publisher.Publish(std::move(builder).Build()).then([](auto f) {
+    return f.get().status();
+  });
+}
+
+// Index an object, or schedule a new request to index a sub-prefix.
+void IndexEntry(ListingContext& ctx, ListingResult& result,
+                gcs::ObjectOrPrefix const& entry) {
+  if (absl::holds_alternative<std::string>(entry)) {
+    auto const& p = absl::get<std::string>(entry);
+    // Do not reschedule the same prefix we are processing.
+    if (ctx.prefix.has_value() && ctx.prefix.value() == p) return;
+    result.pending.push_back(
+        ctx.publisher
+            .Publish(pubsub::MessageBuilder{}
+                         .InsertAttribute("bucket", ctx.bucket)
+                         .InsertAttribute("prefix", p)
+                         .Build())
+            .then([](auto f) { return f.get().status(); }));
+    return;
+  }
+  auto const& object = absl::get<gcs::ObjectMetadata>(entry);
+  ctx.batcher->Push(UpdateObjectMetadata(object));
+  ++result.mutation_count;
+}
+
+// Index the entries in [start, ctx.end), skipping any entry named `skip`.
+ListingResult IndexRange(ListingContext ctx, gcs::StartOffset const& start,
+                         std::string const& skip) {
+  ListingResult result;
+  for (auto const& entry : ctx.client.ListObjectsAndPrefixes(
+           ctx.bucket, ctx.prefix, start, ctx.end, gcs::Delimiter("/"))) {
+    ThrowIfNotOkay("listing bucket " + ctx.bucket, entry.status());
+    auto name = absl::visit(EntryName{}, *entry);
+    if (name == skip) continue;
+    if (std::chrono::steady_clock::now() >= ctx.deadline) {
+      result.pending.push_back(PublishRange(ctx, std::move(name)));
+      break;
+    }
+    IndexEntry(ctx, result, *entry);
+  }
+  return result;
+}
+
+// Return the name of the first entry in [start, ctx.end), if any.
+absl::optional<std::string> FirstEntry(ListingContext& ctx,
+                                       std::string const& start) {
+  for (auto const& entry : ctx.client.ListObjectsAndPrefixes(
+           ctx.bucket, ctx.prefix, gcs::StartOffset(start), ctx.end,
+           gcs::Delimiter("/"), gcs::MaxResults(1))) {
+    ThrowIfNotOkay("listing bucket " + ctx.bucket, entry.status());
+    return absl::visit(EntryName{}, *entry);
+  }
+  return absl::nullopt;
+}
+
+// Pick the boundaries to split the entries after `last` in several ranges.
+//
+// We find the longest prefix of `last` shared by all the remaining entries,
+// using a binary search where each step is a single-entry listing. The
+// remaining entries are then split on the next character, using the
+// characters found in the sample as candidates. Some of these ranges may
+// be empty, but listing an empty range is a single (cheap) request.
+std::vector<std::string> RangeBoundaries(ListingContext& ctx,
+                                         std::string const& last,
+                                         std::set<char> const& alphabet) {
+  auto const prefix_size =
+      ctx.prefix.has_value() ? ctx.prefix.value().size() : std::size_t{0};
+  // Only split on printable ASCII characters, other characters are (likely)
+  // part of UTF-8 sequences.
+  auto const printable = [](char c) { return c >= ' ' && c < '~'; };
+  // Compare as unsigned, that is the order used by GCS.
+  auto const after = [](char a, char b) {
+    return static_cast<unsigned char>(a) > static_cast<unsigned char>(b);
+  };
+  auto const ascii_end = std::find_if_not(last.begin() + prefix_size,
+                                          last.end(), printable);
+  // The smallest string after all the strings starting with `last[0, n)`.
+  auto successor = [&last](std::size_t n) {
+    auto s = last.substr(0, n);
+    ++s.back();
+    return s;
+  };
+  std::size_t lo = prefix_size;
+  auto hi = static_cast<std::size_t>(ascii_end - last.begin());
+  while (lo < hi) {
+    auto const mid = (lo + hi + 1) / 2;
+    if (FirstEntry(ctx, successor(mid)).has_value()) {
+      hi = mid - 1;
+    } else {
+      lo = mid;
+    }
+  }
+  // All the remaining entries are `last` or within a single sub-prefix.
+  if (lo == last.size()) return {};
+  auto const shared = last.substr(0, lo);
+  if (shared.find('/', prefix_size) != std::string::npos) return {};
+
+  std::vector<std::string> candidates;
+  for (auto c : alphabet) {
+    if (printable(c) && after(c, last[lo])) candidates.push_back(shared + c);
+  }
+  auto const max_boundaries = std::size_t{kMaxListingRanges - 1};
+  if (candidates.size() <= max_boundaries) return candidates;
+  std::vector<std::string> boundaries(max_boundaries);
+  for (std::size_t i = 0; i != max_boundaries; ++i) {
+    boundaries[i] = candidates[(i + 1) * candidates.size() / kMaxListingRanges];
+  }
+  return boundaries;
+}
+
 }  // namespace
 
 gcf::HttpResponse IndexGcsPrefix(gcf::HttpRequest request) {  // NOLINT
@@ -104,57 +370,62 @@ gcf::HttpResponse IndexGcsPrefix(gcf::HttpRequest request) {  // NOLINT
     if (!attributes.contains("start")) return gcs::StartOffset();
     return gcs::StartOffset(attributes.value("start", ""));
   }();
+  auto const end = [&attributes]() {
+    if (!attributes.contains("end")) return gcs::EndOffset();
+    return gcs::EndOffset(attributes.value("end", ""));
+  }();
 
-  auto client = gcs::Client();
-  auto publisher = GetPublisher();
+  ListingContext ctx{gcs::Client(), GetPublisher(), bucket, prefix, end,
+                     deadline,
+                     std::make_shared<CommitBatcher>(GetSpannerClient())};
 
-  int mutation_count = 0;
-  std::vector<google::cloud::future<google::cloud::Status>> pending;
-  for (auto const& entry : client.ListObjectsAndPrefixes(bucket, prefix, start,
-                                                         gcs::Delimiter("/"))) {
+  // Index a (cheap) sample of the listing. Most prefixes are small and are
+  // completely indexed by this loop.
+  auto const prefix_size =
+      prefix.has_value() ? prefix.value().size() : std::size_t{0};
+  ListingResult result;
+  std::string last;
+  std::set<char> alphabet;
+  int sample_count = 0;
+  for (auto const& entry : ctx.client.ListObjectsAndPrefixes(
+           bucket, prefix, start, end, gcs::Delimiter("/"),
+           gcs::MaxResults(kSampleSize))) {
     ThrowIfNotOkay("listing bucket " + bucket, entry.status());
+    last = absl::visit(EntryName{}, *entry);
     if (std::chrono::steady_clock::now() >= deadline) {
-      struct SplitPoint {
-        std::string operator()(std::string const& s) { return s; }
-        std::string operator()(gcs::ObjectMetadata const& o) {
-          return o.name();
-        }
-      };
-      std::string start = absl::visit(SplitPoint{}, *entry);
-      auto builder = pubsub::MessageBuilder{}
-                         .InsertAttribute("bucket", bucket)
-                         .InsertAttribute("start", std::move(start));
-      if (prefix.has_value()) {
-        builder.InsertAttribute("prefix", prefix.value());
-      }
-      pending.push_back(
-          publisher.Publish(std::move(builder).Build()).then([](auto f) {
-            return f.get().status();
-          }));
+      result.pending.push_back(PublishRange(ctx, last));
       break;
     }
+    IndexEntry(ctx, result, *entry);
+    alphabet.insert(last.begin() + prefix_size, last.end());
+    // Stop at the end of the first page, before requesting the next one.
+    if (++sample_count == kSampleSize) break;
+  }
 
-    if (absl::holds_alternative<std::string>(*entry)) {
-      auto const& p = absl::get<std::string>(*entry);
-      // Do not reschedule the same prefix we are processing.
-      if (prefix.has_value() && prefix.value() == p) continue;
-      pending.push_back(publisher
-                            .Publish(pubsub::MessageBuilder{}
-                                         .InsertAttribute("bucket", bucket)
-                                         .InsertAttribute("prefix", p)
-                                         .Build())
-                            .then([](auto f) { return f.get().status(); }));
-    } else {
-      auto const& object = absl::get<gcs::ObjectMetadata>(*entry);
-      auto update = UpdateObjectMetadata(object);
-      GetSpannerClient()
-          .Commit(
-              [m = std::move(update)](auto) { return spanner::Mutations{m}; })
-          .value();
-      ++mutation_count;
+  // The prefix is large, split the rest of the listing in several ranges and
+  // list them in parallel.
+  std::size_t range_count = 0;
+  if (sample_count == kSampleSize) {
+    auto const boundaries = RangeBoundaries(ctx, last, alphabet);
+    std::vector<std::future<ListingResult>> ranges;
+    auto range_start = last;
+    for (auto const& b : boundaries) {
+      auto range = ctx;
+      range.end = gcs::EndOffset(b);
+      ranges.push_back(std::async(std::launch::async, IndexRange,
+                                  std::move(range),
+                                  gcs::StartOffset(range_start), last));
+      range_start = b;
     }
+    ranges.push_back(std::async(std::launch::async, IndexRange, ctx,
+                                gcs::StartOffset(range_start), last));
+    range_count = ranges.size();
+    for (auto& r : ranges) Merge(result, r.get());
   }
-  publisher.Flush();
+
+  ThrowIfNotOkay("committing mutations", ctx.batcher->Finish());
+  ctx.publisher.Flush();
+  auto& pending = result.pending;
   google::cloud::Status status;
   for (auto& p : pending) {
     auto publish_status = p.get();
@@ -162,7 +433,8 @@ gcf::HttpResponse IndexGcsPrefix(gcf::HttpRequest request) {  // NOLINT
     status = std::move(publish_status);
   }
   ThrowIfNotOkay("publishing one or more messages", status);
-  std::cout << "DEBUG inserted " << mutation_count << " rows and sent "
-            << pending.size() << " messages\n";
+  std::cout << "DEBUG inserted " << result.mutation_count
+            << " rows and sent " << pending.size() << " messages, listing "
+            << range_count << " ranges in parallel\n";
   return gcf::HttpResponse{};
 }
@@ -43,7 +43,8 @@ spec:
             '/r/populate_bucket', 'worker',
             '--project={{project}}',
             '--subscription=populate-bucket',
-            '--concurrency=16'
+            '--concurrency=16',
+            '--max-workers={{max_workers}}'
         ]
         resources:
           requests:
@@ -61,7 +62,11 @@ parser.add_argument('--image-version', type=str,
 parser.add_argument('--namespace', type=str,
                     default='populate-bucket',
                     help='the GKE namespace')
+parser.add_argument('--max-workers', type=int,
+                    default=200,
+                    help='the maximum number of workers, they share the initial write rate')
 args = parser.parse_args()
 
 print(
-    template.render(action='deploy', project=args.project, image_version=args.image_version, namespace=args.namespace))
+    template.render(action='deploy', project=args.project, image_version=args.image_version, namespace=args.namespace,
+                    max_workers=args.max_workers))
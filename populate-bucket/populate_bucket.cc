@@ -12,14 +12,28 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <absl/strings/string_view.h>
 #include <boost/program_options.hpp>
 #include <crc32c/crc32c.h>
 #include <google/cloud/pubsub/publisher.h>
 #include <google/cloud/pubsub/subscriber.h>
 #include <google/cloud/storage/client.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
 #include <random>
+#include <sstream>
 #include <thread>
 #include <tuple>
 #include <vector>
@@ -34,6 +48,7 @@ std::tuple<po::variables_map, po::options_description> parse_command_line(
 
 void schedule(po::variables_map const&);
 void worker(po::variables_map const&);
+void verify(po::variables_map const&);
 
 }  // namespace
 
@@ -52,6 +67,7 @@ int main(int argc, char* argv[]) try {
       {"help", help},
       {"schedule", schedule},
       {"worker", worker},
+      {"verify", verify},
   };
 
   auto const action_name = vm["action"].as<std::string>();
@@ -80,6 +96,10 @@ std::tuple<po::variables_map, po::options_description> parse_command_line(
     int argc, char* argv[]) {
   auto const default_object_count = 1'000'000L;
   auto const default_minimum_item_size = 1'000L;
+  auto const default_max_pending_messages = 10'000L;
+  auto const default_max_pending_bytes = 16 * 1024 * 1024L;
+  auto const default_object_size = 64L;
+  auto const default_maximum_object_size = 64 * 1024 * 1024L;
 
   po::positional_options_description positional;
   positional.add("action", 1);
@@ -91,6 +111,7 @@ std::tuple<po::variables_map, po::options_description> parse_command_line(
        "the execution mode:\n"
        "- `schedule` to setup a number of work items in the task queue\n"
        "- `worker` to run as a worker listening on the task queue\n"
+       "- `verify` to count the objects created in the bucket\n"
        "- `help` to produce some help\n")
       //
       ("project",
@@ -111,12 +132,72 @@ std::tuple<po::variables_map, po::options_description> parse_command_line(
       ("use-hash-prefix", po::value<bool>()->default_value(true),
        "prefix the object names with a hash to avoid hot spots in GCS")
       //
+      ("seed", po::value<std::uint64_t>(),
+       "seed the generator for the object names, runs with the same seed and "
+       "options create the same object names, by default use a random seed")
+      //
+      ("size-distribution", po::value<std::string>()->default_value("fixed"),
+       "the distribution of the object sizes: `fixed`, `uniform`, "
+       "`lognormal`, or `histogram`")
+      //
+      ("object-size", po::value<long>()->default_value(default_object_size),
+       "the object size with `fixed`, and the median object size with "
+       "`lognormal`")
+      //
+      ("minimum-object-size", po::value<long>()->default_value(0),
+       "the smallest object size with `uniform`")
+      //
+      ("maximum-object-size",
+       po::value<long>()->default_value(default_maximum_object_size),
+       "the largest object size with `uniform`, larger sizes from the other "
+       "distributions are reduced to this value")
+      //
+      ("size-sigma", po::value<double>()->default_value(1.0),
+       "the standard deviation of the logarithm of the object sizes with "
+       "`lognormal`")
+      //
+      ("size-histogram-file", po::value<std::string>(),
+       "with `histogram`, a file with a `size weight` pair in each line, each "
+       "size is used with a probability proportional to its weight")
+      //
       ("task-size", po::value<long>()->default_value(default_minimum_item_size),
        "each work item created by schedule-job should contain this number of "
        "objects")
       //
+      ("max-pending-messages",
+       po::value<long>()->default_value(default_max_pending_messages),
+       "the schedule action waits for the oldest work items to be published "
+       "once this many work items are pending")
+      //
+      ("max-pending-bytes",
+       po::value<long>()->default_value(default_max_pending_bytes),
+       "the schedule action blocks once the pending work items use this many "
+       "bytes")
+      //
       ("concurrency", po::value<int>()->default_value(8),
-       "number of parallel handlers to handle work items");
+       "number of parallel handlers to handle work items, or with `verify`, "
+       "the number of parallel list requests")
+      //
+      ("shard-prefix-length", po::value<int>()->default_value(2),
+       "with `verify`, list the objects in shards, using all the possible "
+       "object name prefixes with this many characters of the hash, or of "
+       "the random name if --use-hash-prefix is false")
+      //
+      ("inserts-in-flight", po::value<int>()->default_value(32),
+       "number of objects each handler creates in parallel")
+      //
+      ("initial-write-rate", po::value<double>()->default_value(1000),
+       "the initial limit for the objects created per second by all the "
+       "workers, each worker starts at its share of this rate, see "
+       "--max-workers, use 0 to disable the limit")
+      //
+      ("max-workers", po::value<int>()->default_value(1),
+       "the maximum number of workers creating objects in parallel, for "
+       "example the maximum size of the GKE deployment, each worker starts "
+       "at --initial-write-rate divided by this number")
+      //
+      ("rate-doubling-interval", po::value<int>()->default_value(20),
+       "double the write rate limit every this many minutes");
 
   po::variables_map vm;
   po::store(po::command_line_parser(argc, argv)
@@ -129,17 +210,50 @@ std::tuple<po::variables_map, po::options_description> parse_command_line(
   return {vm, desc};
 }
 
-/// Create a random object name fragment.
+constexpr std::uint64_t power(std::uint64_t base, int exponent) {
+  return exponent == 0 ? 1 : base * power(base, exponent - 1);
+}
+
+/**
+ * Create a random object name fragment.
+ *
+ * Each value from @p gen provides several characters, as its base 36 digits.
+ * Unlike `std::uniform_int_distribution`, the results are the same with any
+ * standard library, so the same seed creates the same names on any platform.
+ */
 std::string random_alphanum_string(std::mt19937_64& gen, int n) {
-  char const alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
-  std::string result;
-  std::generate_n(std::back_inserter(result), n, [&] {
-    return alphabet[std::uniform_int_distribution<int>(
-        0, sizeof(alphabet) - 1)(gen)];
-  });
+  static char const kAlphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+  // Do not count the NUL terminator.
+  auto constexpr kAlphabetSize = sizeof(kAlphabet) - 1;
+  // 36^12 is the largest power of 36 that fits in 64 bits.
+  auto constexpr kDigits = 12;
+  auto constexpr kRange = power(kAlphabetSize, kDigits);
+  // Discard the values past the last multiple of kRange, otherwise some
+  // characters would be more likely than others.
+  auto constexpr kLimit =
+      (std::numeric_limits<std::uint64_t>::max)() / kRange * kRange;
+
+  std::string result(n, '\0');
+  for (int i = 0; i < n;) {
+    auto v = gen();
+    if (v >= kLimit) continue;
+    for (int d = 0; d != kDigits && i != n; ++d, ++i) {
+      result[i] = kAlphabet[v % kAlphabetSize];
+      v /= kAlphabetSize;
+    }
+  }
   return result;
 }
 
+/// The object name prefix for the work item starting at @p offset.
+std::string make_prefix(std::mt19937_64& gen, long offset) {
+  std::ostringstream os;
+  os << "name-" << random_alphanum_string(gen, 32) << "-offset-"
+     << std::setw(8) << std::setfill('0') << std::hex
+     << static_cast<std::int64_t>(offset);
+  return std::move(os).str();
+}
+
 /// Prepend a hash to an object name for better performance in GCS.
 std::string hashed_name(bool use_hash_prefix, std::string object_name) {
   if (not use_hash_prefix) return std::move(object_name);
@@ -152,20 +266,148 @@ std::string hashed_name(bool use_hash_prefix, std::string object_name) {
   return buf + object_name;
 }
 
+/// The distribution of the object sizes in a work item.
+struct size_distribution {
+  std::string name;
+  std::int64_t object_size;
+  std::int64_t minimum;
+  std::int64_t maximum;
+  double sigma;
+  // The `size:weight` pairs of a histogram, separated by commas.
+  std::string histogram;
+};
+
+/// Load a histogram file, with a `size weight` pair in each line.
+std::string load_size_histogram(std::string const& filename) {
+  std::ifstream is(filename);
+  if (not is) throw std::runtime_error("cannot open " + filename);
+  std::ostringstream histogram;
+  double total_weight = 0;
+  for (std::string line; std::getline(is, line);) {
+    if (line.empty() or line.front() == '#') continue;
+    std::istringstream fields(line);
+    std::int64_t size;
+    double weight;
+    if (not(fields >> size >> weight) or size < 0 or weight < 0) {
+      throw std::runtime_error("invalid line in " + filename + ": " + line);
+    }
+    if (histogram.tellp() > 0) histogram << ',';
+    histogram << size << ':' << weight;
+    total_weight += weight;
+  }
+  // std::discrete_distribution requires a positive total weight.
+  if (not(total_weight > 0)) {
+    throw std::runtime_error("the weights in " + filename +
+                             " must add up to a positive value");
+  }
+  return std::move(histogram).str();
+}
+
+size_distribution make_size_distribution(po::variables_map const& vm) {
+  auto d = size_distribution{vm["size-distribution"].as<std::string>(),
+                             vm["object-size"].as<long>(),
+                             vm["minimum-object-size"].as<long>(),
+                             vm["maximum-object-size"].as<long>(),
+                             vm["size-sigma"].as<double>(),
+                             {}};
+  if (d.object_size < 0 or d.minimum < 0 or d.maximum < d.minimum) {
+    throw std::runtime_error("invalid object size options");
+  }
+  if (d.name == "fixed" or d.name == "uniform") return d;
+  if (d.name == "lognormal") {
+    if (d.object_size == 0 or d.sigma < 0) {
+      throw std::runtime_error(
+          "`lognormal` requires a positive --object-size and --size-sigma");
+    }
+    return d;
+  }
+  if (d.name != "histogram") {
+    throw std::runtime_error("unknown --size-distribution " + d.name);
+  }
+  if (vm.count("size-histogram-file") == 0) {
+    throw std::runtime_error("`histogram` requires --size-histogram-file");
+  }
+  d.histogram =
+      load_size_histogram(vm["size-histogram-file"].as<std::string>());
+  // Cloud Pub/Sub limits the size of each attribute value.
+  auto constexpr kMaxAttributeSize = 1024;
+  if (d.histogram.size() > kMaxAttributeSize) {
+    throw std::runtime_error("the histogram has too many entries");
+  }
+  return d;
+}
+
+/// Pick the sizes of @p count objects.
+std::vector<std::int64_t> sample_sizes(size_distribution const& d,
+                                       std::mt19937_64& gen,
+                                       std::int64_t count) {
+  std::function<double()> sample = [&] {
+    return static_cast<double>(d.object_size);
+  };
+  if (d.name == "uniform") {
+    sample = [&, u = std::uniform_int_distribution<std::int64_t>(
+                     d.minimum, d.maximum)]() mutable {
+      return static_cast<double>(u(gen));
+    };
+  } else if (d.name == "lognormal") {
+    sample = [&, l = std::lognormal_distribution<double>(
+                     std::log(static_cast<double>(d.object_size)),
+                     d.sigma)]() mutable { return l(gen); };
+  } else if (d.name == "histogram") {
+    std::vector<double> sizes;
+    std::vector<double> weights;
+    std::istringstream is(d.histogram);
+    for (std::string entry; std::getline(is, entry, ',');) {
+      auto const colon = entry.find(':');
+      sizes.push_back(std::stod(entry.substr(0, colon)));
+      weights.push_back(std::stod(entry.substr(colon + 1)));
+    }
+    sample = [&gen, sizes = std::move(sizes),
+              h = std::discrete_distribution<std::size_t>(
+                  weights.begin(), weights.end())]() mutable {
+      return sizes[h(gen)];
+    };
+  }
+  std::vector<std::int64_t> result(count);
+  std::generate(result.begin(), result.end(), [&] {
+    // Clamp before the conversion, converting an out of range value is
+    // undefined behavior.
+    auto const s = sample();
+    if (not(s > 0)) return std::int64_t{0};
+    if (not(s < static_cast<double>(d.maximum))) return d.maximum;
+    return static_cast<std::int64_t>(s);
+  });
+  return result;
+}
+
 struct work_item {
   std::string bucket;
   std::string prefix;
   std::int64_t object_count;
   bool use_hash_prefix;
+  size_distribution sizes;
 };
 
 work_item parse_message(pubsub::Message const& m) {
   auto attributes = m.attributes();
+  // Work items published by older versions do not have the size attributes.
+  auto attribute = [&](std::string const& key, std::string fallback) {
+    auto l = attributes.find(key);
+    return l == attributes.end() ? fallback : l->second;
+  };
   return work_item{
       attributes.at("bucket"),
       attributes.at("prefix"),
       std::stoll(attributes.at("object_count")),
       attributes.at("use_hash_prefix") == "true",
+      size_distribution{
+          attribute("size_distribution", "fixed"),
+          std::stoll(attribute("object_size", "64")),
+          std::stoll(attribute("minimum_object_size", "0")),
+          std::stoll(attribute("maximum_object_size", "67108864")),
+          std::stod(attribute("size_sigma", "1")),
+          attribute("size_histogram", ""),
+      },
   };
 }
 
@@ -175,7 +417,13 @@ pubsub::Message format_work_item(work_item wi) {
           {"bucket", std::move(wi.bucket)},
           {"prefix", std::move(wi.prefix)},
           {"object_count", std::to_string(wi.object_count)},
-          {"use_hash_prefix", wi.object_count ? "true" : "false"},
+          {"use_hash_prefix", wi.use_hash_prefix ? "true" : "false"},
+          {"size_distribution", std::move(wi.sizes.name)},
+          {"object_size", std::to_string(wi.sizes.object_size)},
+          {"minimum_object_size", std::to_string(wi.sizes.minimum)},
+          {"maximum_object_size", std::to_string(wi.sizes.maximum)},
+          {"size_sigma", std::to_string(wi.sizes.sigma)},
+          {"size_histogram", std::move(wi.sizes.histogram)},
       })
       .Build();
 }
@@ -199,19 +447,49 @@ void schedule(boost::program_options::variables_map const& vm) {
   auto const task_size = vm["task-size"].as<long>();
   auto const project_id = vm["project"].as<std::string>();
   auto const topic_id = vm["topic"].as<std::string>();
+  auto const sizes = make_size_distribution(vm);
+
+  auto const max_pending_messages = vm["max-pending-messages"].as<long>();
+  auto const max_pending_bytes = vm["max-pending-bytes"].as<long>();
+  if (max_pending_messages <= 0 or max_pending_bytes <= 0) {
+    throw std::runtime_error(
+        "the --max-pending-messages and --max-pending-bytes options must be "
+        "positive");
+  }
 
+  // The work items are small messages, with only a few attributes. Batch as
+  // many of them as Cloud Pub/Sub allows in each request, and block the
+  // publisher, instead of buffering without bounds, if it falls behind.
+  using namespace std::chrono_literals;
   auto const topic = pubsub::Topic(project_id, topic_id);
-  auto publisher = pubsub::Publisher(
-      pubsub::MakePublisherConnection(topic, google::cloud::Options{}));
-
-  auto make_prefix = [g = std::mt19937_64(std::random_device{}())](
-                         long offset) mutable {
-    std::ostringstream os;
-    os << "name-" << random_alphanum_string(g, 32) << "-offset-" << std::setw(8)
-       << std::setfill('0') << std::hex << static_cast<std::int64_t>(offset);
-    return std::move(os).str();
+  auto publisher = pubsub::Publisher(pubsub::MakePublisherConnection(
+      topic,
+      google::cloud::Options{}
+          .set<pubsub::MaxBatchMessagesOption>(1000)
+          .set<pubsub::MaxBatchBytesOption>(1024 * 1024)
+          .set<pubsub::MaxHoldTimeOption>(50ms)
+          .set<pubsub::MaxPendingMessagesOption>(max_pending_messages)
+          .set<pubsub::MaxPendingBytesOption>(max_pending_bytes)
+          .set<pubsub::FullPublisherActionOption>(
+              pubsub::FullPublisherAction::kBlocks)));
+
+  // Print the seed, so the same object names can be created again.
+  auto const seed = vm.count("seed") != 0 ? vm["seed"].as<std::uint64_t>()
+                                          : std::random_device{}();
+  std::cout << "Using --seed=" << seed << std::endl;
+  auto gen = std::mt19937_64(seed);
+  // Only keep the results of the most recent work items, so the memory usage
+  // does not depend on --object-count.
+  std::deque<google::cloud::future<google::cloud::Status>> pending_publish;
+  std::map<google::cloud::StatusCode, std::int64_t> error_count;
+  auto reap = [&](std::size_t max_pending) {
+    while (pending_publish.size() > max_pending) {
+      auto const code = pending_publish.front().get().code();
+      pending_publish.pop_front();
+      if (code == google::cloud::StatusCode::kOk) continue;
+      ++error_count[code];
+    }
   };
-  std::vector<google::cloud::future<google::cloud::Status>> pending_publish;
 
   std::cout << "Generating work items" << std::flush;
   auto next_report = object_count / 10;
@@ -220,22 +498,18 @@ void schedule(boost::program_options::variables_map const& vm) {
       std::cout << '.' << std::flush;
       next_report += object_count / 10;
     }
-    auto prefix = make_prefix(offset);
+    auto prefix = make_prefix(gen, offset);
     auto const task_objects_count =
         (std::min)(task_size, object_count - offset);
     pending_publish.push_back(
         publisher
-            .Publish(format_work_item(
-                work_item{bucket, prefix, task_objects_count, use_hash_prefix}))
+            .Publish(format_work_item(work_item{
+                bucket, prefix, task_objects_count, use_hash_prefix, sizes}))
             .then([](auto f) { return f.get().status(); }));
+    reap(static_cast<std::size_t>(max_pending_messages));
   }
+  reap(0);
   std::cout << "DONE" << std::endl;
-  std::map<google::cloud::StatusCode, std::int64_t> error_count;
-  for (auto& f : pending_publish) {
-    auto const code = f.get().code();
-    if (code == google::cloud::StatusCode::kOk) continue;
-    ++error_count[code];
-  }
   if (error_count.empty()) return;
   std::cerr << "Errors publishing messages: ";
   std::int64_t total_count = 0;
@@ -247,20 +521,258 @@ void schedule(boost::program_options::variables_map const& vm) {
                            std::to_string(total_count));
 }
 
-std::string create_contents(work_item const& wi, long index) {
-  std::ostringstream os;
-  os << "Prefix: " << wi.prefix << "\nUse Hash Prefix: " << std::boolalpha
-     << wi.use_hash_prefix << "\nObject Index: " << index << "\n";
-  return std::move(os).str();
+/**
+ * A block of random data shared by all the objects created by a worker.
+ *
+ * The contents of each object are a slice of this block, so creating an
+ * object does not allocate or generate any data. The block grows to the
+ * largest object size requested so far, the objects being created keep the
+ * previous block alive.
+ */
+class random_payload {
+ public:
+  std::shared_ptr<std::string const> get(std::int64_t size) {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (block_ and static_cast<std::int64_t>(block_->size()) >= size) {
+      return block_;
+    }
+    auto block = std::make_shared<std::string>(size, '\0');
+    std::mt19937_64 gen;
+    for (std::int64_t i = 0; i < size; i += sizeof(std::uint64_t)) {
+      auto const r = gen();
+      std::memcpy(block->data() + i, &r,
+                  (std::min<std::int64_t>)(sizeof(r), size - i));
+    }
+    block_ = std::move(block);
+    return block_;
+  }
+
+ private:
+  std::mutex mu_;
+  std::shared_ptr<std::string const> block_;
+};
+
+/**
+ * Limits the rate of object creation in a worker.
+ *
+ * This is a token bucket, holding up to one second worth of tokens. GCS
+ * recommends starting at 1000 writes per second for each bucket, and
+ * doubling the rate every 20 minutes, so the limiter doubles its rate every
+ * `doubling_interval`. Throttling errors halve the rate, and restart the
+ * ramp-up from the lower rate.
+ */
+class write_rate_limiter {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  write_rate_limiter(double initial_rate,
+                     std::chrono::minutes doubling_interval)
+      : enabled_(initial_rate > 0),
+        rate_(initial_rate),
+        doubling_interval_(doubling_interval),
+        next_(clock::now()),
+        last_change_(next_),
+        last_backoff_(next_ - kBackoffInterval) {}
+
+  /// Wait until the next object can be created.
+  void acquire() {
+    if (not enabled_) return;
+    std::unique_lock<std::mutex> lk(mu_);
+    auto const now = clock::now();
+    while (now - last_change_ >= doubling_interval_) {
+      rate_ *= 2;
+      last_change_ += doubling_interval_;
+    }
+    // Each object consumes the token available at `next_`, any tokens unused
+    // for more than a second are lost.
+    next_ = (std::max)(next_, now - std::chrono::seconds(1));
+    auto const slot = next_;
+    next_ += std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double>(1.0 / rate_));
+    lk.unlock();
+    std::this_thread::sleep_until(slot);
+  }
+
+  /// Slow down after a throttling error.
+  void throttled() {
+    std::lock_guard<std::mutex> lk(mu_);
+    ++throttle_events_;
+    if (not enabled_) return;
+    // The inserts in flight fail together, only back off once for them.
+    auto const now = clock::now();
+    if (now - last_backoff_ < kBackoffInterval) return;
+    rate_ = (std::max)(kMinimumRate, rate_ / 2);
+    last_backoff_ = now;
+    last_change_ = now;
+  }
+
+  double rate() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return rate_;
+  }
+
+  std::int64_t throttle_events() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return throttle_events_;
+  }
+
+ private:
+  static auto constexpr kMinimumRate = 1.0;
+  static auto constexpr kBackoffInterval = std::chrono::seconds(1);
+
+  bool const enabled_;
+  mutable std::mutex mu_;
+  double rate_;
+  std::chrono::minutes const doubling_interval_;
+  clock::time_point next_;
+  clock::time_point last_change_;
+  clock::time_point last_backoff_;
+  std::int64_t throttle_events_ = 0;
+};
+
+/**
+ * A fixed pool of threads creating the objects of all the work items.
+ *
+ * The threads are created once per worker, not once per work item. Each work
+ * item keeps at most `--inserts-in-flight` tasks in the pool, so with
+ * `--concurrency` work items the queue holds at most one task per thread.
+ */
+class insert_pool {
+ public:
+  explicit insert_pool(int thread_count) {
+    for (int i = 0; i != thread_count; ++i) {
+      threads_.emplace_back([this] { run(); });
+    }
+  }
+
+  ~insert_pool() {
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      shutdown_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_) t.join();
+  }
+
+  insert_pool(insert_pool const&) = delete;
+  insert_pool& operator=(insert_pool const&) = delete;
+
+  void submit(std::function<void()> task) {
+    std::lock_guard<std::mutex> lk(mu_);
+    tasks_.push_back(std::move(task));
+    cv_.notify_one();
+  }
+
+ private:
+  void run() {
+    std::unique_lock<std::mutex> lk(mu_);
+    for (;;) {
+      cv_.wait(lk, [this] { return shutdown_ or not tasks_.empty(); });
+      if (tasks_.empty()) return;
+      auto task = std::move(tasks_.front());
+      tasks_.pop_front();
+      lk.unlock();
+      task();
+      lk.lock();
+    }
+  }
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> tasks_;
+  bool shutdown_ = false;
+  std::vector<std::thread> threads_;
+};
+
+/// Return true for the errors returned by GCS when it throttles requests.
+bool is_throttling_error(google::cloud::Status const& status) {
+  using google::cloud::StatusCode;
+  return status.code() == StatusCode::kResourceExhausted or
+         status.code() == StatusCode::kUnavailable;
+}
+
+/// Return true for other transient errors, retried without slowing down.
+bool is_transient_error(google::cloud::Status const& status) {
+  using google::cloud::StatusCode;
+  return status.code() == StatusCode::kInternal or
+         status.code() == StatusCode::kDeadlineExceeded;
 }
 
-void process_one_item(gcs::Client client, pubsub::Message const& m) {
+struct item_result {
+  std::int64_t inserted = 0;
+  std::int64_t bytes = 0;
+  std::vector<std::pair<std::string, google::cloud::Status>> errors;
+};
+
+// Each object creation is retried this many times after throttling or
+// transient errors.
+auto constexpr kMaxInsertAttempts = 10;
+// The initial delay before retrying a transient error, doubled on each
+// consecutive failure.
+auto constexpr kTransientBackoff = std::chrono::milliseconds(100);
+
+/// Create the objects in a work item, with up to @p window inserts in flight.
+item_result process_one_item(gcs::Client client, random_payload& payload,
+                             write_rate_limiter& limiter, insert_pool& pool,
+                             pubsub::Message const& m, int window) {
   auto wi = parse_message(m);
-  for (std::int64_t i = 0; i != wi.object_count; ++i) {
+  // Seed the generator from the work item, so the objects have the same sizes
+  // if the work item is delivered again.
+  auto gen = std::mt19937_64(crc32c::Crc32c(wi.prefix));
+  auto const sizes = sample_sizes(wi.sizes, gen, wi.object_count);
+  auto const block = payload.get(
+      sizes.empty() ? 0 : *std::max_element(sizes.begin(), sizes.end()));
+  std::vector<std::size_t> offsets(sizes.size());
+  std::transform(sizes.begin(), sizes.end(), offsets.begin(), [&](auto size) {
+    return std::uniform_int_distribution<std::size_t>(
+        0, block->size() - size)(gen);
+  });
+
+  std::mutex mu;
+  std::condition_variable cv;
+  std::int64_t in_flight = 0;
+  item_result result;
+  // Each task creates one object, a failed insert does not stop the other
+  // objects in the work item.
+  auto insert = [&](std::int64_t i) {
     auto object_name = wi.prefix + "/object-" + std::to_string(i);
     auto hashed = hashed_name(wi.use_hash_prefix, std::move(object_name));
-    client.InsertObject(wi.bucket, hashed, create_contents(wi, i)).value();
+    auto const size = static_cast<std::size_t>(sizes[i]);
+    auto const contents = absl::string_view(block->data() + offsets[i], size);
+    // The client does not retry, so throttling errors reach the limiter
+    // right away, and it can slow down before the next insert. Other
+    // transient errors are retried here, with a backoff.
+    auto status = google::cloud::Status{};
+    auto backoff = kTransientBackoff;
+    for (int attempt = 0; attempt != kMaxInsertAttempts; ++attempt) {
+      limiter.acquire();
+      status = client.InsertObject(wi.bucket, hashed, contents).status();
+      if (is_throttling_error(status)) {
+        limiter.throttled();
+        continue;
+      }
+      if (not is_transient_error(status)) break;
+      std::this_thread::sleep_for(backoff);
+      backoff *= 2;
+    }
+    std::lock_guard<std::mutex> lk(mu);
+    --in_flight;
+    cv.notify_all();
+    if (status.ok()) {
+      ++result.inserted;
+      result.bytes += sizes[i];
+      return;
+    }
+    result.errors.emplace_back(std::move(hashed), std::move(status));
+  };
+  std::unique_lock<std::mutex> lk(mu);
+  for (std::int64_t i = 0; i != wi.object_count; ++i) {
+    cv.wait(lk, [&] { return in_flight < window; });
+    ++in_flight;
+    pool.submit([&insert, i] { insert(i); });
   }
+  cv.wait(lk, [&] { return in_flight == 0; });
+  return result;
 }
 
 /// Run the worker thread for a GKE batch job.
@@ -274,8 +786,27 @@ void worker(boost::program_options::variables_map const& vm) {
     throw std::runtime_error("the `schedule` action requires --subscription");
   }
   auto const concurrency = vm["concurrency"].as<int>();
+  auto const inserts_in_flight = vm["inserts-in-flight"].as<int>();
+  auto const initial_write_rate = vm["initial-write-rate"].as<double>();
+  auto const max_workers = vm["max-workers"].as<int>();
+  auto const rate_doubling_interval =
+      std::chrono::minutes(vm["rate-doubling-interval"].as<int>());
   auto const project_id = vm["project"].as<std::string>();
   auto const subscription_id = vm["subscription"].as<std::string>();
+  if (inserts_in_flight <= 0) {
+    throw std::runtime_error("the --inserts-in-flight option must be positive");
+  }
+  if (initial_write_rate < 0 or rate_doubling_interval.count() <= 0 or
+      max_workers <= 0) {
+    throw std::runtime_error(
+        "the --initial-write-rate option cannot be negative, and the "
+        "--rate-doubling-interval and --max-workers options must be positive");
+  }
+  // The GCS guidance applies to the bucket, the workers split the initial
+  // rate, and each one ramps up independently.
+  auto const worker_write_rate = initial_write_rate / max_workers;
+  std::cout << "Initial write rate limit for this worker is "
+            << worker_write_rate << " objects per second" << std::endl;
 
   using namespace std::chrono_literals;
   using std::chrono::duration_cast;
@@ -294,15 +825,39 @@ void worker(boost::program_options::variables_map const& vm) {
   std::atomic<std::int64_t> latency{0};
   std::atomic<std::int64_t> attempts{0};
   std::atomic<std::int64_t> counter{0};
-  auto handler = [&, cl = gcs::Client::CreateDefaultClient().value()](
-                     pubsub::Message const& m, pubsub::AckHandler h) {
+  std::atomic<std::int64_t> objects{0};
+  std::atomic<std::int64_t> bytes{0};
+  std::atomic<std::int64_t> errors{0};
+  // All the handlers share the client, keep enough connections for all the
+  // inserts in flight.
+  auto client = gcs::Client(
+      google::cloud::Options{}
+          .set<gcs::ConnectionPoolSizeOption>(concurrency * inserts_in_flight)
+          .set<gcs::RetryPolicyOption>(
+              gcs::LimitedErrorCountRetryPolicy(0).clone()));
+  random_payload payload;
+  write_rate_limiter limiter(worker_write_rate, rate_doubling_interval);
+  insert_pool pool(concurrency * inserts_in_flight);
+  auto handler = [&, cl = std::move(client)](pubsub::Message const& m,
+                                             pubsub::AckHandler h) {
     auto const start = std::chrono::steady_clock::now();
-    process_one_item(cl, m);
+    auto result =
+        process_one_item(cl, payload, limiter, pool, m, inserts_in_flight);
     auto const elapsed = std::chrono::steady_clock::now() - start;
     latency.fetch_add(duration_cast<milliseconds>(elapsed).count());
     attempts.fetch_add(h.delivery_attempt());
+    objects.fetch_add(result.inserted);
+    bytes.fetch_add(result.bytes);
     ++counter;
-    std::move(h).ack();
+    if (result.errors.empty()) return std::move(h).ack();
+    // Some objects are missing, let Cloud Pub/Sub deliver the work item
+    // again. Creating the existing objects again is harmless.
+    errors.fetch_add(static_cast<std::int64_t>(result.errors.size()));
+    auto const& [name, status] = result.errors.front();
+    std::cerr << "Errors creating " << result.errors.size()
+              << " objects in work item, first error in " << name << ": "
+              << status << std::endl;
+    std::move(h).nack();
   };
 
   using namespace std::chrono_literals;
@@ -313,13 +868,24 @@ void worker(boost::program_options::variables_map const& vm) {
     if (total == 0) return 0;
     return v / total;
   };
+  auto last_report = std::chrono::steady_clock::now();
   while (session.wait_for(30s) == std::future_status::timeout) {
     auto last = counter.exchange(0);
     total += last;
+    auto const now = std::chrono::steady_clock::now();
+    auto const elapsed_ms = duration_cast<milliseconds>(now - last_report);
+    last_report = now;
+    auto const ms = (std::max<std::int64_t>)(1, elapsed_ms.count());
+    auto const objects_per_second = objects.exchange(0) * 1000 / ms;
+    auto const MiB_per_second = bytes.exchange(0) * 1000 / ms / (1024 * 1024);
     std::cout << "Processed " << last << " work items"
               << ", latency=" << mean(latency.load())
               << ", attempts=" << mean(attempts.load()) << ", count=" << total
-              << std::endl;
+              << ", objects/s=" << objects_per_second
+              << ", MiB/s=" << MiB_per_second
+              << ", write-rate-limit=" << limiter.rate()
+              << ", throttled=" << limiter.throttle_events()
+              << ", errors=" << errors.load() << std::endl;
   }
 
   auto status = session.get();
@@ -330,4 +896,132 @@ void worker(boost::program_options::variables_map const& vm) {
   throw std::runtime_error(std::move(os).str());
 }
 
+/**
+ * The prefixes used to list the objects in parallel.
+ *
+ * The object names start with the hex digits of their hash, or with the
+ * random characters of their work item prefix. Either way, the names are
+ * evenly distributed across all the prefixes of the same length.
+ */
+std::vector<std::string> shard_prefixes(bool use_hash_prefix, int length) {
+  std::string const digits = use_hash_prefix
+                                 ? "0123456789abcdef"
+                                 : "abcdefghijklmnopqrstuvwxyz0123456789";
+  std::vector<std::string> shards{use_hash_prefix ? "" : "name-"};
+  for (int i = 0; i != length; ++i) {
+    std::vector<std::string> next;
+    for (auto const& s : shards) {
+      for (auto d : digits) next.push_back(s + d);
+    }
+    shards = std::move(next);
+  }
+  return shards;
+}
+
+/// Extract the work item prefix from an object name.
+std::string work_item_prefix(bool use_hash_prefix, std::string const& name) {
+  auto const start = use_hash_prefix ? name.find('_') + 1 : 0;
+  return name.substr(start, name.rfind("/object-") - start);
+}
+
+/// Report at most this many mismatched work items.
+auto constexpr kMaxReportedItems = 100;
+
+/// Count the objects in the bucket, and compare against the expected counts.
+void verify(boost::program_options::variables_map const& vm) {
+  std::cout << "Verifying the objects in the bucket" << std::endl;
+
+  if (vm.count("bucket") == 0) {
+    throw std::runtime_error("the `verify` action requires --bucket");
+  }
+  auto const bucket = vm["bucket"].as<std::string>();
+  auto const object_count = vm["object-count"].as<long>();
+  auto const use_hash_prefix = vm["use-hash-prefix"].as<bool>();
+  auto const task_size = vm["task-size"].as<long>();
+  auto const concurrency = vm["concurrency"].as<int>();
+  auto const shard_prefix_length = vm["shard-prefix-length"].as<int>();
+  if (shard_prefix_length < 0 or concurrency <= 0) {
+    throw std::runtime_error(
+        "the --shard-prefix-length option cannot be negative, and the "
+        "--concurrency option must be positive");
+  }
+
+  auto const shards = shard_prefixes(use_hash_prefix, shard_prefix_length);
+  std::cout << "Listing " << shards.size() << " shards with " << concurrency
+            << " parallel requests" << std::endl;
+  auto client = gcs::Client(
+      google::cloud::Options{}.set<gcs::ConnectionPoolSizeOption>(concurrency));
+  std::atomic<std::size_t> next_shard{0};
+  std::mutex mu;
+  std::map<std::string, std::int64_t> found;
+  std::int64_t list_errors = 0;
+  auto lister = [&] {
+    for (auto i = next_shard++; i < shards.size(); i = next_shard++) {
+      // Count in a local map, to avoid locking for each object.
+      std::map<std::string, std::int64_t> counts;
+      std::int64_t errors = 0;
+      for (auto& o : client.ListObjects(bucket, gcs::Prefix(shards[i]))) {
+        if (not o) {
+          std::cerr << "Error listing shard " << shards[i] << ": "
+                    << o.status() << std::endl;
+          ++errors;
+          break;
+        }
+        ++counts[work_item_prefix(use_hash_prefix, o->name())];
+      }
+      std::lock_guard<std::mutex> lk(mu);
+      for (auto const& [prefix, count] : counts) found[prefix] += count;
+      list_errors += errors;
+    }
+  };
+  auto const start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads(concurrency);
+  for (auto& t : threads) t = std::thread(lister);
+  for (auto& t : threads) t.join();
+  auto const elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+
+  auto const total = std::accumulate(
+      found.begin(), found.end(), std::int64_t{0},
+      [](auto a, auto const& kv) { return a + kv.second; });
+  std::cout << "Found " << total << " objects in " << found.size()
+            << " work items, expected " << object_count << " objects, in "
+            << elapsed.count() << "ms ("
+            << total * 1000 / (std::max<std::int64_t>)(1, elapsed.count())
+            << " objects/s)" << std::endl;
+
+  // With the seed used by `schedule`, compare each work item.
+  std::int64_t mismatched_items = 0;
+  if (vm.count("seed") != 0) {
+    auto gen = std::mt19937_64(vm["seed"].as<std::uint64_t>());
+    for (long offset = 0; offset < object_count; offset += task_size) {
+      auto const prefix = make_prefix(gen, offset);
+      auto const expected = (std::min)(task_size, object_count - offset);
+      auto l = found.find(prefix);
+      auto const count = l == found.end() ? std::int64_t{0} : l->second;
+      if (l != found.end()) found.erase(l);
+      if (count == expected) continue;
+      if (++mismatched_items <= kMaxReportedItems) {
+        std::cerr << "Work item " << prefix << " has " << count
+                  << " objects, expected " << expected << "\n";
+      }
+    }
+    for (auto const& [prefix, count] : found) {
+      if (++mismatched_items <= kMaxReportedItems) {
+        std::cerr << "Unexpected work item " << prefix << " has " << count
+                  << " objects\n";
+      }
+    }
+  }
+
+  if (list_errors == 0 and mismatched_items == 0 and total == object_count) {
+    std::cout << "The bucket contents match the expected counts" << std::endl;
+    return;
+  }
+  throw std::runtime_error(
+      "Verification failed, objects=" + std::to_string(total) +
+      ", mismatched work items=" + std::to_string(mismatched_items) +
+      ", list errors=" + std::to_string(list_errors));
+}
+
 }  // namespace